@@ -0,0 +1,51 @@
+/* Cost of a passing assertion, one BENCH per macro family.
+ *
+ * Each body loads its operands through volatile pointers so the compiler
+ * cannot fold the check away; the `baseline` bench measures that load and
+ * the loop alone, to be subtracted from the others. Build with -O2. */
+
+/* Every iteration counts an assertion into an int; keep the runs short
+ * enough that the totals cannot overflow */
+#define BETATEST_BENCH_WARMUP_MS 20
+#define BETATEST_BENCH_SAMPLE_MS 1
+#define BETATEST_BENCH_SAMPLES 30
+#include "betatest.h"
+
+static volatile int int_value = 42;
+static volatile double double_value = 0.5;
+static const char *volatile str_value = "the quick brown fox";
+static const char str_expected[] = "the quick brown fox";
+static unsigned char mem_a[64];
+static unsigned char mem_b[64];
+static unsigned char *volatile mem_ptr = mem_b;
+static int array_a[16];
+static int array_b[16];
+static int *volatile array_ptr = array_b;
+
+BENCH(baseline) { BETATEST_DO_NOT_OPTIMIZE(int_value); }
+
+BENCH(assert_true) { ASSERT_TRUE(int_value == 42); }
+
+BENCH(assert_int_eq) { ASSERT_INT_EQ(int_value, 42); }
+
+BENCH(assert_eq) { ASSERT_EQ(int_value, 42); }
+
+BENCH(assert_lt) { ASSERT_LT(int_value, 43); }
+
+BENCH(assert_not_null) { ASSERT_NOT_NULL(str_value); }
+
+BENCH(assert_msg) { ASSERT_MSG(int_value == 42, "value was %d", int_value); }
+
+BENCH(assert_float_eq) { ASSERT_FLOAT_EQ(double_value, 0.5, 1e-9); }
+
+BENCH(assert_str_eq) { ASSERT_STR_EQ(str_value, str_expected); }
+
+BENCH(assert_str_contains) { ASSERT_STR_CONTAINS(str_value, "brown"); }
+
+BENCH(assert_str_matches) { ASSERT_STR_MATCHES(str_value, "^the .* fox$"); }
+
+BENCH(assert_mem_eq_64) { ASSERT_MEM_EQ(mem_a, mem_ptr, sizeof(mem_a)); }
+
+BENCH(assert_array_int_eq_16) { ASSERT_ARRAY_INT_EQ(array_a, array_ptr, 16); }
+
+BETATEST_MAIN()
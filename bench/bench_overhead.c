@@ -0,0 +1,277 @@
+/* What the framework costs beyond single assertions: compile time and
+ * object size of generated files with many tests, the runner's overhead per
+ * test, and the price of printing every pass.
+ *
+ *     bench_overhead [--tests=N[,N...]] [--runs=N] [--dir=PATH] [--cc=CC]
+ *
+ * Each generated test makes one passing assertion. The runner overhead is
+ * the difference in wall time between a binary with N tests and one with
+ * none, divided by N, taking the best of --runs runs with stdout on
+ * /dev/null. The build bakes in the compiler (BETATEST_BENCH_CC), the
+ * directory of betatest.h (BETATEST_BENCH_INCLUDE) and where to put the
+ * generated files (BETATEST_BENCH_DIR). */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef BETATEST_BENCH_CC
+#define BETATEST_BENCH_CC "cc"
+#endif
+
+#ifndef BETATEST_BENCH_INCLUDE
+#define BETATEST_BENCH_INCLUDE "."
+#endif
+
+#ifndef BETATEST_BENCH_DIR
+#define BETATEST_BENCH_DIR "."
+#endif
+
+#define MAX_SIZES 8
+#define MAX_BUILDS 32
+
+typedef struct {
+    const char *name;
+    const char *defines[3];
+} variant;
+
+static const variant variants[] = {
+    {"default", {NULL}},
+    {"PRINT_ON_PASS", {"-DBETATEST_PRINT_ON_PASS", NULL}},
+    {"PRINT_ON_PASS + NO_COLOR",
+     {"-DBETATEST_PRINT_ON_PASS", "-DBETATEST_NO_COLOR", NULL}},
+};
+
+#define NVARIANTS (int)(sizeof(variants) / sizeof(variants[0]))
+
+typedef struct {
+    int ntests;
+    const char *opt;
+    int variant;
+    char exe[512];
+    double compile_ms;
+    long long object_bytes;
+} build;
+
+static struct {
+    const char *cc;
+    const char *dir;
+    int sizes[MAX_SIZES];
+    int nsizes;
+    int runs;
+    build builds[MAX_BUILDS];
+    int nbuilds;
+} bench = {BETATEST_BENCH_CC, BETATEST_BENCH_DIR, {1000, 10000}, 2, 5,
+           {{0}}, 0};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Run argv with stdout (and stderr) on /dev/null when `quiet`. Returns the
+ * exit status, or -1 if it could not be run or was killed. */
+static int run(char *const argv[], int quiet) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        if (quiet) {
+            int null = open("/dev/null", O_WRONLY);
+            if (null >= 0) {
+                dup2(null, STDOUT_FILENO);
+                dup2(null, STDERR_FILENO);
+                close(null);
+            }
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "cannot run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int generate(const char *path, int ntests) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "#include \"betatest.h\"\n\n"
+               "static volatile int one = 1;\n\n");
+    for (int i = 0; i < ntests; i++) {
+        fprintf(f, "TEST(test_%d) { ASSERT_INT_EQ(one * %d, %d); }\n", i, i,
+                i);
+    }
+    fprintf(f, "\nBETATEST_MAIN()\n");
+    return fclose(f);
+}
+
+/* Generate, compile and link a file with `ntests` tests, once per
+ * combination of size, optimisation level and variant */
+static build *get_build(int ntests, const char *opt, int v) {
+    for (int i = 0; i < bench.nbuilds; i++) {
+        build *b = &bench.builds[i];
+        if (b->ntests == ntests && strcmp(b->opt, opt) == 0 &&
+            b->variant == v) {
+            return b;
+        }
+    }
+    if (bench.nbuilds == MAX_BUILDS) {
+        return NULL;
+    }
+    build *b = &bench.builds[bench.nbuilds];
+    char src[512];
+    char obj[512];
+    snprintf(src, sizeof(src), "%s/gen_%d.c", bench.dir, ntests);
+    snprintf(obj, sizeof(obj), "%s/gen_%d%s_%d.o", bench.dir, ntests, opt, v);
+    snprintf(b->exe, sizeof(b->exe), "%s/gen_%d%s_%d", bench.dir, ntests, opt,
+             v);
+    if (generate(src, ntests) != 0) {
+        return NULL;
+    }
+
+    char include[512];
+    snprintf(include, sizeof(include), "-I%s", BETATEST_BENCH_INCLUDE);
+    char *argv[16];
+    int argc = 0;
+    argv[argc++] = (char *)bench.cc;
+    argv[argc++] = (char *)opt;
+    argv[argc++] = include;
+    for (int i = 0; variants[v].defines[i] != NULL; i++) {
+        argv[argc++] = (char *)variants[v].defines[i];
+    }
+    argv[argc++] = (char *)"-c";
+    argv[argc++] = src;
+    argv[argc++] = (char *)"-o";
+    argv[argc++] = obj;
+    argv[argc] = NULL;
+    long long start = now_ns();
+    if (run(argv, 0) != 0) {
+        fprintf(stderr, "cannot compile %s\n", src);
+        return NULL;
+    }
+    b->compile_ms = (double)(now_ns() - start) / 1e6;
+    struct stat st;
+    b->object_bytes = stat(obj, &st) == 0 ? (long long)st.st_size : 0;
+
+    char *link[] = {(char *)bench.cc, obj,          (char *)"-o",
+                    b->exe,           (char *)"-lm", (char *)"-pthread",
+                    NULL};
+    if (run(link, 0) != 0) {
+        fprintf(stderr, "cannot link %s\n", b->exe);
+        return NULL;
+    }
+    b->ntests = ntests;
+    b->opt = opt;
+    b->variant = v;
+    bench.nbuilds++;
+    return b;
+}
+
+/* Best wall time in ms of running a build, or -1 if it failed */
+static double best_run_ms(const build *b) {
+    char *argv[] = {(char *)b->exe, NULL};
+    double best = -1;
+    for (int i = 0; i < bench.runs; i++) {
+        long long start = now_ns();
+        if (run(argv, 1) != 0) {
+            fprintf(stderr, "%s failed\n", b->exe);
+            return -1;
+        }
+        double ms = (double)(now_ns() - start) / 1e6;
+        if (best < 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+static int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--tests=", 8) == 0) {
+            bench.nsizes = 0;
+            for (const char *p = arg + 8; *p && bench.nsizes < MAX_SIZES;) {
+                int n = atoi(p);
+                if (n <= 0) {
+                    return -1;
+                }
+                bench.sizes[bench.nsizes++] = n;
+                p += strcspn(p, ",");
+                p += *p == ',';
+            }
+        } else if (strncmp(arg, "--runs=", 7) == 0) {
+            bench.runs = atoi(arg + 7);
+        } else if (strncmp(arg, "--dir=", 6) == 0) {
+            bench.dir = arg + 6;
+        } else if (strncmp(arg, "--cc=", 5) == 0) {
+            bench.cc = arg + 5;
+        } else {
+            return -1;
+        }
+    }
+    return bench.nsizes > 0 && bench.runs > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) != 0) {
+        fprintf(stderr,
+                "Usage: %s [--tests=N[,N...]] [--runs=N] [--dir=PATH] "
+                "[--cc=CC]\n",
+                argv[0]);
+        return 2;
+    }
+    mkdir(bench.dir, 0777);
+
+    static const char *opts[] = {"-O0", "-O2"};
+    printf("Compile cost (%s):\n", bench.cc);
+    printf("   tests  flags   compile ms   object KiB  bytes/test\n");
+    for (int i = 0; i < bench.nsizes; i++) {
+        for (int o = 0; o < 2; o++) {
+            build *b = get_build(bench.sizes[i], opts[o], 0);
+            if (b == NULL) {
+                return 1;
+            }
+            printf("  %6d  %-5s  %11.1f  %11.1f  %10lld\n", b->ntests, b->opt,
+                   b->compile_ms, (double)b->object_bytes / 1024.0,
+                   b->object_bytes / b->ntests);
+            fflush(stdout);
+        }
+    }
+
+    int ntests = bench.sizes[0];
+    printf("\nRunner overhead (-O2, %d tests, best of %d runs, output on "
+           "/dev/null):\n",
+           ntests, bench.runs);
+    printf("  variant                     run ms  empty ms  us/test\n");
+    for (int v = 0; v < NVARIANTS; v++) {
+        build *full = get_build(ntests, "-O2", v);
+        build *empty = get_build(0, "-O2", v);
+        if (full == NULL || empty == NULL) {
+            return 1;
+        }
+        double full_ms = best_run_ms(full);
+        double empty_ms = best_run_ms(empty);
+        if (full_ms < 0 || empty_ms < 0) {
+            return 1;
+        }
+        printf("  %-24s  %8.2f  %8.2f  %7.3f\n", variants[v].name, full_ms,
+               empty_ms, (full_ms - empty_ms) * 1000.0 / ntests);
+        fflush(stdout);
+    }
+    return 0;
+}
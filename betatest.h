@@ -1,11 +1,31 @@
 #ifndef BETATEST_H
 #define BETATEST_H
 
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <regex.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 /* Configuration */
 #ifndef BETATEST_NO_COLOR
@@ -26,200 +46,4675 @@
 #define BETATEST_DO_PRINT_PASS 1
 #endif
 
-#ifndef BETATEST_PRINT_NOT_ON_FAIL
-#define BETATEST_DO_PRINT_FAIL 1
-#else
-#define BETATEST_DO_PRINT_FAIL 0
-#endif
+#ifndef BETATEST_PRINT_NOT_ON_FAIL
+#define BETATEST_DO_PRINT_FAIL 1
+#else
+#define BETATEST_DO_PRINT_FAIL 0
+#endif
+
+/* Tests slower than this many milliseconds of wall time are flagged (0 = off,
+ * the BETATEST_SLOW_THRESHOLD_MS environment variable overrides it) */
+#ifndef BETATEST_SLOW_THRESHOLD_MS
+#define BETATEST_SLOW_THRESHOLD_MS 0
+#endif
+
+/* Number of entries in the slowest tests table of TEST_SUMMARY (0 = off) */
+#ifndef BETATEST_SLOWEST_COUNT
+#define BETATEST_SLOWEST_COUNT 5
+#endif
+
+/* Failure messages kept per test for the machine-readable reporters */
+#ifndef BETATEST_REPORT_MAX_FAILURES
+#define BETATEST_REPORT_MAX_FAILURES 32
+#endif
+
+/* Upper bound in bytes on the output buffered for one test; anything past
+ * it is dropped and replaced by a truncation marker */
+#ifndef BETATEST_OUTPUT_CAP
+#define BETATEST_OUTPUT_CAP (1024 * 1024)
+#endif
+
+/* Benchmarks: warmup time, target time per sample and number of samples */
+#ifndef BETATEST_BENCH_WARMUP_MS
+#define BETATEST_BENCH_WARMUP_MS 50
+#endif
+
+#ifndef BETATEST_BENCH_SAMPLE_MS
+#define BETATEST_BENCH_SAMPLE_MS 2
+#endif
+
+#ifndef BETATEST_BENCH_SAMPLES
+#define BETATEST_BENCH_SAMPLES 50
+#endif
+
+/* STRESS_TEST: on average one sched_yield or short pause per this many
+ * iterations of each thread, to widen race windows (0 = none; the
+ * BETATEST_STRESS_JITTER environment variable overrides it) */
+#ifndef BETATEST_STRESS_JITTER
+#define BETATEST_STRESS_JITTER 0
+#endif
+
+/* ASSERT_EVENTUALLY: first and longest sleep between two checks of the
+ * condition, in microseconds; the sleep doubles after every check */
+#ifndef BETATEST_EVENTUALLY_MIN_US
+#define BETATEST_EVENTUALLY_MIN_US 10
+#endif
+
+#ifndef BETATEST_EVENTUALLY_MAX_US
+#define BETATEST_EVENTUALLY_MAX_US 10000
+#endif
+
+/* MEASURE: timed runs per block (after one warmup run), and the slowdown of
+ * the median over the baseline that counts as a regression (the
+ * BETATEST_REGRESSION_THRESHOLD_PCT environment variable overrides it) */
+#ifndef BETATEST_MEASURE_SAMPLES
+#define BETATEST_MEASURE_SAMPLES 20
+#endif
+
+#ifndef BETATEST_REGRESSION_THRESHOLD_PCT
+#define BETATEST_REGRESSION_THRESHOLD_PCT 10
+#endif
+
+#ifndef BETATEST_BOOTSTRAP_RESAMPLES
+#define BETATEST_BOOTSTRAP_RESAMPLES 1000
+#endif
+
+/* Default per-test timeout in milliseconds (0 = none, the BETATEST_TIMEOUT_MS
+ * environment variable overrides it), and the signal the watchdog uses to
+ * interrupt a test that runs past it */
+#ifndef BETATEST_TIMEOUT_MS
+#define BETATEST_TIMEOUT_MS 0
+#endif
+
+#ifndef BETATEST_TIMEOUT_SIGNAL
+#define BETATEST_TIMEOUT_SIGNAL SIGUSR2
+#endif
+
+/* Recover from crashing tests without --catch-crashes (the
+ * BETATEST_CATCH_CRASHES environment variable overrides it), and the size of
+ * the alternate stack the crash handlers run on */
+#ifndef BETATEST_CATCH_CRASHES
+#define BETATEST_CATCH_CRASHES 0
+#endif
+
+#ifndef BETATEST_CRASH_STACK_SIZE
+#define BETATEST_CRASH_STACK_SIZE (64 * 1024)
+#endif
+
+/* Color codes */
+#if BETATEST_USE_COLOR
+#define BETATEST_COLOR_GREEN "\033[32m"
+#define BETATEST_COLOR_RED "\033[31m"
+#define BETATEST_COLOR_YELLOW "\033[33m"
+#define BETATEST_COLOR_CYAN "\033[36m"
+#define BETATEST_COLOR_RESET "\033[0m"
+#define BETATEST_COLOR_BOLD "\033[1m"
+#else
+#define BETATEST_COLOR_GREEN ""
+#define BETATEST_COLOR_RED ""
+#define BETATEST_COLOR_YELLOW ""
+#define BETATEST_COLOR_CYAN ""
+#define BETATEST_COLOR_RESET ""
+#define BETATEST_COLOR_BOLD ""
+#endif
+
+/* Framework state is static by default, so each file that includes the
+ * header has its own copy. To link several test files into one runner,
+ * build all of them with BETATEST_EXTERN defined and exactly one of them
+ * with BETATEST_IMPLEMENTATION too: that file defines the state and the
+ * others declare it extern, so the registry, the stats and the reporters
+ * are shared. */
+#if defined(BETATEST_IMPLEMENTATION)
+#define BETATEST_DATA
+#define BETATEST_INIT(...) = __VA_ARGS__
+#elif defined(BETATEST_EXTERN)
+#define BETATEST_DATA extern
+#define BETATEST_INIT(...)
+#else
+#define BETATEST_DATA static
+#define BETATEST_INIT(...) = __VA_ARGS__
+#endif
+
+/* Test statistics */
+BETATEST_DATA struct {
+    int tests_run;
+    int tests_passed;
+    int tests_failed;
+    int assertions_run;
+    int assertions_passed;
+    int assertions_failed;
+    int tests_slow;
+    int tests_timed_out;
+    int current_test_failed;
+    const char *current_test_name;
+} betatest_stats BETATEST_INIT({0, 0, 0, 0, 0, 0, 0, 0, 0, NULL});
+
+/* Per-test timings, in the order the tests finished */
+typedef struct {
+    const char *name;
+    int failed;
+    long long wall_ns;
+    long long cpu_ns;
+} betatest_timing;
+
+BETATEST_DATA struct {
+    betatest_timing *entries;
+    int count;
+    int cap;
+} betatest_timings BETATEST_INIT({NULL, 0, 0});
+
+/* Print helpers */
+#define BETATEST_PRINT_PASS()                                                  \
+    betatest_printf("%s[PASS]%s ", BETATEST_COLOR_GREEN, BETATEST_COLOR_RESET)
+
+#define BETATEST_PRINT_FAIL()                                                  \
+    betatest_printf("%s[FAIL]%s ", BETATEST_COLOR_RED, BETATEST_COLOR_RESET)
+
+#define BETATEST_PRINT_INFO()                                                  \
+    betatest_printf("%s[INFO]%s ", BETATEST_COLOR_CYAN, BETATEST_COLOR_RESET)
+
+/* Internal helpers are static in every file, even when BETATEST_DATA state
+ * is shared between files */
+#define BETATEST_FUNC static __attribute__((unused))
+
+/* Out-of-line failure paths: kept apart from the hot code that calls them */
+#define BETATEST_COLD static __attribute__((unused, cold, noinline))
+
+#define BETATEST_LIKELY(x) __builtin_expect(!!(x), 1)
+
+typedef void (*betatest_fn)(void);
+
+/* Make room for one more element in a growable array. Returns 0 on success
+ * and leaves the array untouched when out of memory. */
+BETATEST_FUNC int betatest_grow(void *items, int *cap, int count,
+                                size_t size) {
+    if (count < *cap) {
+        return 0;
+    }
+    int grown_cap = *cap ? *cap * 2 : 64;
+    void *grown = realloc(*(void **)items, (size_t)grown_cap * size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *(void **)items = grown;
+    *cap = grown_cap;
+    return 0;
+}
+
+BETATEST_FUNC int betatest_write_full(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+BETATEST_FUNC int betatest_read_full(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, p + got, len - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return got == 0 ? 0 : -1;
+        }
+        got += (size_t)n;
+    }
+    return 1;
+}
+
+/* 64-bit FNV-1a */
+BETATEST_FUNC unsigned long betatest_hash_str(const char *s,
+                                              unsigned long hash) {
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/* Timeouts
+ *
+ * When a test runs past its timeout the watchdog thread sends
+ * BETATEST_TIMEOUT_SIGNAL to the thread running it, and the handler jumps
+ * back to the runner. Framework locks are taken with betatest_lock, which
+ * puts the jump off until the runner holds none of them. Locks inside the C
+ * library (malloc, stdio) or the test cannot be protected that way, so the
+ * process is not trusted after a jump: the test is reported and no further
+ * tests run in it. Under RUN_ALL_TESTS_PARALLEL a new worker takes over. */
+BETATEST_DATA struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pid_t pid; /* process the watchdog thread runs in */
+    pthread_t runner;
+    long long deadline_ns; /* CLOCK_MONOTONIC, 0 when disarmed */
+    volatile sig_atomic_t armed;
+    int default_ms; /* --timeout, -1 when not given */
+} betatest_watchdog BETATEST_INIT({PTHREAD_MUTEX_INITIALIZER,
+                                    PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, -1});
+
+BETATEST_DATA sigjmp_buf betatest_call_jump;
+/* Set once a call has been interrupted; see betatest_stop_running */
+BETATEST_DATA int betatest_interrupted BETATEST_INIT(0);
+BETATEST_DATA __thread volatile sig_atomic_t
+    betatest_locks_held BETATEST_INIT(0);
+BETATEST_DATA __thread volatile sig_atomic_t
+    betatest_timeout_pending BETATEST_INIT(0);
+
+/* Source location of an assertion */
+typedef struct {
+    const char *file;
+    int line;
+} betatest_site;
+
+/* Where the last assertion on this thread was evaluated. Assertion macros
+ * point it at their own static site; the others copy theirs into
+ * betatest_site_copy. */
+BETATEST_DATA __thread const betatest_site
+    *betatest_last_site BETATEST_INIT(NULL);
+BETATEST_DATA __thread betatest_site betatest_site_copy;
+
+static inline void betatest_note_site(const char *file, int line) {
+    betatest_site_copy.file = file;
+    betatest_site_copy.line = line;
+    betatest_last_site = &betatest_site_copy;
+}
+
+BETATEST_FUNC void betatest_timeout_handler(int sig) {
+    (void)sig;
+    if (!betatest_watchdog.armed) {
+        return;
+    }
+    if (betatest_locks_held > 0) {
+        betatest_timeout_pending = 1;
+        return;
+    }
+    betatest_watchdog.armed = 0;
+    siglongjmp(betatest_call_jump, 1);
+}
+
+static inline void betatest_lock(pthread_mutex_t *lock) {
+    betatest_locks_held++;
+    pthread_mutex_lock(lock);
+}
+
+static inline void betatest_unlock(pthread_mutex_t *lock) {
+    pthread_mutex_unlock(lock);
+    if (--betatest_locks_held == 0 && betatest_timeout_pending) {
+        betatest_timeout_pending = 0;
+        betatest_timeout_handler(BETATEST_TIMEOUT_SIGNAL);
+    }
+}
+
+/* Allocation tracking
+ *
+ * With BETATEST_TRACK_ALLOCS defined, the file including this header
+ * replaces malloc, calloc, realloc, free, memalign, aligned_alloc and
+ * posix_memalign with versions that count into betatest_allocs before
+ * calling the C library's allocator. This catches every allocation in the
+ * process, from shared libraries too. With BETATEST_ALLOC_WRAP also
+ * defined, the __wrap_ versions are defined instead, for linking with
+ * -Wl,--wrap=malloc,--wrap=calloc,...
+ *
+ * The hooks call glibc's __libc_malloc family and malloc_usable_size, so
+ * they need glibc. valloc, pvalloc and memory mapped directly with mmap
+ * are not counted.
+ *
+ * Allocations the framework makes for itself (holding a betatest lock, or
+ * between betatest_untracked++ and --) are not counted. */
+typedef struct {
+    long allocs;
+    long bytes;
+    long peak_bytes;
+    long leaked_blocks;
+    long leaked_bytes;
+} betatest_alloc_stats;
+
+BETATEST_DATA struct {
+    long allocs;
+    long frees;
+    long bytes;
+    long live;
+    long peak;
+} betatest_allocs BETATEST_INIT({0, 0, 0, 0, 0});
+
+BETATEST_DATA __thread int betatest_untracked BETATEST_INIT(0);
+
+/* Allocations of the test that ran last in this process */
+BETATEST_DATA betatest_alloc_stats
+    betatest_test_allocs BETATEST_INIT({0, 0, 0, 0, 0});
+
+/* Counters at the start of a test, see betatest_alloc_begin */
+typedef struct {
+    long allocs;
+    long frees;
+    long bytes;
+    long live;
+    long peak; /* the process-wide peak, restored by betatest_alloc_end */
+} betatest_alloc_mark;
+
+#ifdef BETATEST_TRACK_ALLOCS
+#ifndef __GLIBC__
+#error "BETATEST_TRACK_ALLOCS needs glibc"
+#endif
+#define BETATEST_ALLOCS_TRACKED 1
+#include <malloc.h>
+
+#ifdef BETATEST_ALLOC_WRAP
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+void *__real_memalign(size_t alignment, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+int __real_posix_memalign(void **out, size_t alignment, size_t size);
+#define BETATEST_REAL_ALLOC(fn) __real_##fn
+#define BETATEST_REAL_ALIGNED(fn) __real_##fn
+#define BETATEST_HOOK_ALLOC(fn) __wrap_##fn
+#else
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t alignment, size_t size);
+#define BETATEST_REAL_ALLOC(fn) __libc_##fn
+#define BETATEST_REAL_ALIGNED(fn) betatest_libc_##fn
+#define BETATEST_HOOK_ALLOC(fn) fn
+
+/* glibc exports no __libc_ version of these two */
+static inline void *betatest_libc_aligned_alloc(size_t alignment,
+                                                size_t size) {
+    return __libc_memalign(alignment, size);
+}
+
+static inline int betatest_libc_posix_memalign(void **out, size_t alignment,
+                                               size_t size) {
+    if (alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *ptr = __libc_memalign(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+#endif
+
+static inline int betatest_alloc_tracked(void) {
+    return betatest_locks_held == 0 && betatest_untracked == 0;
+}
+
+BETATEST_FUNC void betatest_alloc_record(void *ptr, size_t size) {
+    if (ptr == NULL || !betatest_alloc_tracked()) {
+        return;
+    }
+    long usable = (long)malloc_usable_size(ptr);
+    __atomic_fetch_add(&betatest_allocs.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&betatest_allocs.bytes, (long)size, __ATOMIC_RELAXED);
+    long live = __atomic_add_fetch(&betatest_allocs.live, usable,
+                                   __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&betatest_allocs.peak, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&betatest_allocs.peak, &peak, live, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+BETATEST_FUNC void betatest_free_record(void *ptr) {
+    if (ptr == NULL || !betatest_alloc_tracked()) {
+        return;
+    }
+    __atomic_fetch_add(&betatest_allocs.frees, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&betatest_allocs.live, (long)malloc_usable_size(ptr),
+                       __ATOMIC_RELAXED);
+}
+
+/* Defined once in a multi-file runner, by the BETATEST_IMPLEMENTATION file */
+#if defined(BETATEST_IMPLEMENTATION) || !defined(BETATEST_EXTERN)
+void *BETATEST_HOOK_ALLOC(malloc)(size_t size) {
+    void *ptr = BETATEST_REAL_ALLOC(malloc)(size);
+    betatest_alloc_record(ptr, size);
+    return ptr;
+}
+
+void *BETATEST_HOOK_ALLOC(calloc)(size_t nmemb, size_t size) {
+    void *ptr = BETATEST_REAL_ALLOC(calloc)(nmemb, size);
+    betatest_alloc_record(ptr, nmemb * size);
+    return ptr;
+}
+
+void *BETATEST_HOOK_ALLOC(realloc)(void *ptr, size_t size) {
+    betatest_free_record(ptr);
+    void *grown = BETATEST_REAL_ALLOC(realloc)(ptr, size);
+    if (grown == NULL && size > 0) {
+        /* ptr is still allocated */
+        if (ptr != NULL && betatest_alloc_tracked()) {
+            __atomic_fetch_sub(&betatest_allocs.frees, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&betatest_allocs.live,
+                               (long)malloc_usable_size(ptr),
+                               __ATOMIC_RELAXED);
+        }
+        return NULL;
+    }
+    betatest_alloc_record(grown, size);
+    return grown;
+}
+
+void BETATEST_HOOK_ALLOC(free)(void *ptr) {
+    betatest_free_record(ptr);
+    BETATEST_REAL_ALLOC(free)(ptr);
+}
+
+void *BETATEST_HOOK_ALLOC(memalign)(size_t alignment, size_t size) {
+    void *ptr = BETATEST_REAL_ALLOC(memalign)(alignment, size);
+    betatest_alloc_record(ptr, size);
+    return ptr;
+}
+
+void *BETATEST_HOOK_ALLOC(aligned_alloc)(size_t alignment, size_t size) {
+    void *ptr = BETATEST_REAL_ALIGNED(aligned_alloc)(alignment, size);
+    betatest_alloc_record(ptr, size);
+    return ptr;
+}
+
+int BETATEST_HOOK_ALLOC(posix_memalign)(void **out, size_t alignment,
+                                        size_t size) {
+    int rc = BETATEST_REAL_ALIGNED(posix_memalign)(out, alignment, size);
+    if (rc == 0) {
+        betatest_alloc_record(*out, size);
+    }
+    return rc;
+}
+#endif
+#else
+#define BETATEST_ALLOCS_TRACKED 0
+#endif
+
+BETATEST_FUNC long betatest_alloc_count(void) {
+    return __atomic_load_n(&betatest_allocs.allocs, __ATOMIC_RELAXED);
+}
+
+/* Mark the start of a test. The peak restarts from the live bytes so the
+ * test's own peak can be read; betatest_alloc_end puts back the larger of
+ * the old and the new peak. */
+BETATEST_FUNC betatest_alloc_mark betatest_alloc_begin(void) {
+    betatest_alloc_mark mark;
+    mark.allocs = __atomic_load_n(&betatest_allocs.allocs, __ATOMIC_RELAXED);
+    mark.frees = __atomic_load_n(&betatest_allocs.frees, __ATOMIC_RELAXED);
+    mark.bytes = __atomic_load_n(&betatest_allocs.bytes, __ATOMIC_RELAXED);
+    mark.live = __atomic_load_n(&betatest_allocs.live, __ATOMIC_RELAXED);
+    mark.peak = __atomic_exchange_n(&betatest_allocs.peak, mark.live,
+                                    __ATOMIC_RELAXED);
+    return mark;
+}
+
+/* Allocation stats since `mark`. Blocks and bytes still live count as
+ * leaked, each on its own: a test that frees an older block can leak new
+ * blocks while the live bytes go down, or the other way round. */
+BETATEST_FUNC betatest_alloc_stats
+betatest_alloc_end(const betatest_alloc_mark *mark) {
+    betatest_alloc_stats stats;
+    long frees = __atomic_load_n(&betatest_allocs.frees, __ATOMIC_RELAXED);
+    long live = __atomic_load_n(&betatest_allocs.live, __ATOMIC_RELAXED);
+    stats.allocs = betatest_alloc_count() - mark->allocs;
+    stats.bytes =
+        __atomic_load_n(&betatest_allocs.bytes, __ATOMIC_RELAXED) - mark->bytes;
+    long peak = __atomic_load_n(&betatest_allocs.peak, __ATOMIC_RELAXED);
+    stats.peak_bytes = peak - mark->live;
+    while (mark->peak > peak &&
+           !__atomic_compare_exchange_n(&betatest_allocs.peak, &peak,
+                                        mark->peak, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+    stats.leaked_blocks = stats.allocs - (frees - mark->frees);
+    stats.leaked_bytes = live - mark->live;
+    if (stats.leaked_blocks < 0) {
+        stats.leaked_blocks = 0;
+    }
+    if (stats.leaked_bytes < 0) {
+        stats.leaked_bytes = 0;
+    }
+    return stats;
+}
+
+/* Output arena
+ *
+ * Everything the reporter prints goes through betatest_printf into one
+ * growable buffer that is written out with a single write(2) when a test
+ * finishes (betatest_flush_output), so output stays cheap with
+ * BETATEST_PRINT_ON_PASS and does not interleave with other threads or
+ * processes. The buffer holds at most BETATEST_OUTPUT_CAP bytes; beyond that
+ * output is dropped and a truncation marker is written instead. A fatal
+ * signal or exit() writes out whatever is pending first. */
+BETATEST_DATA struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t dropped;
+    int fd;
+    int hooks_installed;
+    pthread_mutex_t lock;
+} betatest_output BETATEST_INIT({NULL, 0, 0, 0, STDOUT_FILENO, 0,
+                                  PTHREAD_MUTEX_INITIALIZER});
+
+/* Append to the arena; callers of betatest_vappend/betatest_append hold
+ * betatest_output.lock, everyone else uses betatest_printf */
+BETATEST_FUNC void betatest_vappend(const char *fmt, va_list ap) {
+    va_list retry;
+    va_copy(retry, ap);
+    size_t room = betatest_output.cap - betatest_output.len;
+    int n = vsnprintf(betatest_output.buf ? betatest_output.buf +
+                                                betatest_output.len
+                                          : NULL,
+                      room, fmt, ap);
+    if (n < 0 || (size_t)n < room) {
+        betatest_output.len += n > 0 ? (size_t)n : 0;
+        va_end(retry);
+        return;
+    }
+
+    size_t need = betatest_output.len + (size_t)n + 1;
+    size_t limit = (size_t)BETATEST_OUTPUT_CAP + 1;
+    if (betatest_output.cap < limit && betatest_output.dropped == 0) {
+        size_t cap = betatest_output.cap ? betatest_output.cap : 4096;
+        while (cap < need && cap < limit) {
+            cap *= 2;
+        }
+        cap = cap < limit ? cap : limit;
+        char *buf = (char *)realloc(betatest_output.buf, cap);
+        if (buf != NULL) {
+            betatest_output.buf = buf;
+            betatest_output.cap = cap;
+        }
+    }
+    room = betatest_output.cap - betatest_output.len;
+    if (room > 0) {
+        vsnprintf(betatest_output.buf + betatest_output.len, room, fmt, retry);
+    }
+    if ((size_t)n < room) {
+        betatest_output.len += (size_t)n;
+    } else {
+        size_t kept = room > 0 ? room - 1 : 0;
+        betatest_output.len += kept;
+        betatest_output.dropped += (size_t)n - kept;
+    }
+    va_end(retry);
+}
+
+BETATEST_FUNC __attribute__((format(printf, 1, 2))) void
+betatest_append(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    betatest_vappend(fmt, ap);
+    va_end(ap);
+}
+
+BETATEST_FUNC __attribute__((format(printf, 1, 2))) void
+betatest_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    betatest_lock(&betatest_output.lock);
+    betatest_vappend(fmt, ap);
+    betatest_unlock(&betatest_output.lock);
+    va_end(ap);
+}
+
+/* Write out the arena. Anything the test printed itself through stdio is
+ * flushed first so it keeps its place in front of the report. */
+BETATEST_FUNC void betatest_flush_output(void) {
+    fflush(stdout);
+    betatest_lock(&betatest_output.lock);
+    char marker[96];
+    struct iovec iov[2];
+    int iovcnt = 0;
+    if (betatest_output.len > 0) {
+        iov[iovcnt].iov_base = betatest_output.buf;
+        iov[iovcnt].iov_len = betatest_output.len;
+        iovcnt++;
+    }
+    if (betatest_output.dropped > 0) {
+        int n = snprintf(marker, sizeof(marker),
+                         "\n[... output truncated, %zu bytes dropped ...]\n",
+                         betatest_output.dropped);
+        iov[iovcnt].iov_base = marker;
+        iov[iovcnt].iov_len = (size_t)n;
+        iovcnt++;
+    }
+    /* One writev in the common case; finish a short write piecewise */
+    ssize_t written = iovcnt > 0 ? writev(betatest_output.fd, iov, iovcnt) : 0;
+    size_t skip = written > 0 ? (size_t)written : 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        betatest_write_full(betatest_output.fd, (char *)iov[i].iov_base + skip,
+                            iov[i].iov_len - skip);
+        skip = 0;
+    }
+    betatest_output.len = 0;
+    betatest_output.dropped = 0;
+    betatest_unlock(&betatest_output.lock);
+}
+
+/* Fatal signal: write out what the crashing test reported so far (without
+ * the lock, which may be held) and let the default action run */
+BETATEST_FUNC void betatest_crash_flush(int sig) {
+    (void)sig;
+    if (betatest_output.len > 0) {
+        ssize_t ignored = write(betatest_output.fd, betatest_output.buf,
+                                betatest_output.len);
+        (void)ignored;
+        betatest_output.len = 0;
+    }
+}
+
+BETATEST_FUNC void betatest_exit_flush(void) { betatest_flush_output(); }
+
+/* Install the exit and crash hooks once, leaving user handlers alone */
+BETATEST_FUNC void betatest_output_hooks(void) {
+    static const int signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    if (betatest_output.hooks_installed) {
+        return;
+    }
+    betatest_output.hooks_installed = 1;
+    atexit(betatest_exit_flush);
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        struct sigaction old;
+        if (sigaction(signals[i], NULL, &old) == 0 &&
+            old.sa_handler == SIG_DFL) {
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = betatest_crash_flush;
+            sa.sa_flags = (int)SA_RESETHAND;
+            sigemptyset(&sa.sa_mask);
+            sigaction(signals[i], &sa, NULL);
+        }
+    }
+}
+
+/* Thread-safe assertion counters
+ *
+ * Each thread counts its own assertions in a block that only it writes, so
+ * the pass path is a thread-local load and a plain store with no lock and no
+ * shared cache line. Blocks are linked into a global list the first time a
+ * thread asserts; betatest_sync_counters() folds whatever each block counted
+ * since the previous sync into betatest_stats at the end of every test.
+ * Blocks of exited threads are folded in by a thread-exit destructor and
+ * recycled. */
+typedef struct betatest_counters {
+    long passed;
+    long failed;
+    long synced_passed;
+    long synced_failed;
+    int in_use;
+    struct betatest_counters *next;
+} betatest_counters;
+
+BETATEST_DATA __thread betatest_counters
+    *betatest_thread_block BETATEST_INIT(NULL);
+
+BETATEST_DATA struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key;
+    betatest_counters *head;
+    long retired_passed;
+    long retired_failed;
+} betatest_counter_list BETATEST_INIT({PTHREAD_MUTEX_INITIALIZER,
+                                        PTHREAD_ONCE_INIT, 0, NULL, 0, 0});
+
+/* Thread exit: keep the unsynced counts and free the block for reuse */
+BETATEST_FUNC void betatest_counters_retire(void *block) {
+    betatest_counters *c = (betatest_counters *)block;
+    betatest_lock(&betatest_counter_list.lock);
+    betatest_counter_list.retired_passed += c->passed - c->synced_passed;
+    betatest_counter_list.retired_failed += c->failed - c->synced_failed;
+    c->passed = c->synced_passed = 0;
+    c->failed = c->synced_failed = 0;
+    c->in_use = 0;
+    betatest_unlock(&betatest_counter_list.lock);
+}
+
+BETATEST_FUNC void betatest_counters_init(void) {
+    pthread_key_create(&betatest_counter_list.key, betatest_counters_retire);
+}
+
+/* Slow path of betatest_thread_counters: first assertion on this thread */
+BETATEST_FUNC betatest_counters *betatest_counters_attach(void) {
+    static betatest_counters fallback;
+    pthread_once(&betatest_counter_list.once, betatest_counters_init);
+    betatest_lock(&betatest_counter_list.lock);
+    betatest_counters *c = betatest_counter_list.head;
+    while (c != NULL && c->in_use) {
+        c = c->next;
+    }
+    if (c == NULL) {
+        c = (betatest_counters *)calloc(1, sizeof(betatest_counters));
+        if (c == NULL) {
+            /* Out of memory: such threads share one block. It stays on the
+             * list, never retired, so betatest_sync_counters still folds
+             * it in; only increments that race each other are lost. */
+            c = &fallback;
+            if (!fallback.in_use) {
+                fallback.next = betatest_counter_list.head;
+                betatest_counter_list.head = &fallback;
+            }
+        } else {
+            c->next = betatest_counter_list.head;
+            betatest_counter_list.head = c;
+        }
+    }
+    c->in_use = 1;
+    betatest_unlock(&betatest_counter_list.lock);
+    if (c != &fallback) {
+        pthread_setspecific(betatest_counter_list.key, c);
+    }
+    betatest_thread_block = c;
+    return c;
+}
+
+static inline betatest_counters *betatest_thread_counters(void) {
+    betatest_counters *c = betatest_thread_block;
+    if (__builtin_expect(c != NULL, 1)) {
+        return c;
+    }
+    return betatest_counters_attach();
+}
+
+/* Fold every thread's new assertions into betatest_stats */
+BETATEST_FUNC void betatest_sync_counters(void) {
+    long passed = 0;
+    long failed = 0;
+    betatest_lock(&betatest_counter_list.lock);
+    for (betatest_counters *c = betatest_counter_list.head; c; c = c->next) {
+        long p = __atomic_load_n(&c->passed, __ATOMIC_RELAXED);
+        long f = __atomic_load_n(&c->failed, __ATOMIC_RELAXED);
+        passed += p - c->synced_passed;
+        failed += f - c->synced_failed;
+        c->synced_passed = p;
+        c->synced_failed = f;
+    }
+    passed += betatest_counter_list.retired_passed;
+    failed += betatest_counter_list.retired_failed;
+    betatest_counter_list.retired_passed = 0;
+    betatest_counter_list.retired_failed = 0;
+    betatest_unlock(&betatest_counter_list.lock);
+    betatest_stats.assertions_run += (int)(passed + failed);
+    betatest_stats.assertions_passed += (int)passed;
+    betatest_stats.assertions_failed += (int)failed;
+    if (failed > 0) {
+        betatest_stats.current_test_failed = 1;
+    }
+}
+
+BETATEST_FUNC long long betatest_clock_ns(clockid_t clock) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0) {
+        return 0;
+    }
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+BETATEST_FUNC double betatest_slow_threshold_ms(void) {
+    static double threshold = -1.0;
+    if (threshold < 0.0) {
+        const char *env = getenv("BETATEST_SLOW_THRESHOLD_MS");
+        threshold = env ? atof(env) : (double)BETATEST_SLOW_THRESHOLD_MS;
+        if (threshold < 0.0) {
+            threshold = 0.0;
+        }
+    }
+    return threshold;
+}
+
+BETATEST_FUNC int betatest_is_slow(long long wall_ns) {
+    double threshold = betatest_slow_threshold_ms();
+    return threshold > 0.0 && (double)wall_ns / 1e6 > threshold;
+}
+
+/* Append a finished test to betatest_timings */
+BETATEST_FUNC void betatest_record_timing(const char *name, int failed,
+                                          long long wall_ns, long long cpu_ns) {
+    if (betatest_is_slow(wall_ns)) {
+        betatest_stats.tests_slow++;
+    }
+    if (betatest_grow(&betatest_timings.entries, &betatest_timings.cap,
+                      betatest_timings.count, sizeof(betatest_timing)) != 0) {
+        return;
+    }
+    betatest_timing *t = &betatest_timings.entries[betatest_timings.count++];
+    t->name = name;
+    t->failed = failed;
+    t->wall_ns = wall_ns;
+    t->cpu_ns = cpu_ns;
+}
+
+BETATEST_FUNC void betatest_print_times(long long wall_ns, long long cpu_ns) {
+    betatest_printf("(%.3f ms, cpu %.3f ms", (double)wall_ns / 1e6,
+                    (double)cpu_ns / 1e6);
+    if (BETATEST_ALLOCS_TRACKED) {
+        betatest_printf(", %ld allocs, %ld bytes, peak %ld bytes",
+                        betatest_test_allocs.allocs, betatest_test_allocs.bytes,
+                        betatest_test_allocs.peak_bytes);
+    }
+    betatest_printf(")");
+}
+
+BETATEST_FUNC int betatest_compare_double(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+/* Value at quantile q (0..1) of a sorted array, nearest rank */
+BETATEST_FUNC double betatest_quantile(const double *sorted, int n, double q) {
+    int rank = (int)ceil(q * n);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > n) {
+        rank = n;
+    }
+    return sorted[rank - 1];
+}
+
+BETATEST_FUNC double betatest_median(const double *sorted, int n) {
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0;
+}
+
+/* Performance counters
+ *
+ * With --perf or BETATEST_PERF=1, every test body and benchmark loop is
+ * measured with perf_event_open(2). Hardware events that cannot be opened,
+ * as is common in VMs and containers, are left out. The software events
+ * (context switches, task-clock and page faults) still work anywhere
+ * perf_event_open is allowed. */
+enum {
+    BETATEST_PERF_CYCLES,
+    BETATEST_PERF_INSTRUCTIONS,
+    BETATEST_PERF_CACHE_REFERENCES,
+    BETATEST_PERF_CACHE_MISSES,
+    BETATEST_PERF_BRANCH_MISSES,
+    BETATEST_PERF_CONTEXT_SWITCHES,
+    BETATEST_PERF_TASK_CLOCK, /* nanoseconds */
+    BETATEST_PERF_PAGE_FAULTS,
+    BETATEST_PERF_NCOUNTERS
+};
+
+/* Counter deltas, NAN for counters that are unavailable */
+typedef struct {
+    double values[BETATEST_PERF_NCOUNTERS];
+} betatest_perf_values;
+
+/* Raw readings: value, time enabled, time running */
+typedef struct {
+    unsigned long long raw[BETATEST_PERF_NCOUNTERS][3];
+} betatest_perf_mark;
+
+BETATEST_DATA struct {
+    int enabled; /* -1 until --perf/BETATEST_PERF is looked at */
+    pid_t pid;   /* process the counters were opened in */
+    int available;
+    int fds[BETATEST_PERF_NCOUNTERS];
+} betatest_perf BETATEST_INIT({-1, 0, 0, {-1, -1, -1, -1, -1, -1, -1, -1}});
+
+/* Counters of the test that ran last in this process */
+BETATEST_DATA betatest_perf_values betatest_test_perf BETATEST_INIT({{0}});
+
+BETATEST_FUNC const char *betatest_perf_name(int counter) {
+    static const char *const names[BETATEST_PERF_NCOUNTERS] = {
+        "cycles",       "instructions",     "cache-references",
+        "cache-misses", "branch-misses",    "context-switches",
+        "task-clock",   "page-faults"};
+    return counter >= 0 && counter < BETATEST_PERF_NCOUNTERS ? names[counter]
+                                                            : "unknown";
+}
+
+/* Open the counters, again after a fork. Returns how many are available. */
+BETATEST_FUNC int betatest_perf_open(void) {
+    if (betatest_perf.pid == getpid()) {
+        return betatest_perf.available;
+    }
+    betatest_perf.pid = getpid();
+    betatest_perf.available = 0;
+#ifdef __linux__
+    static const unsigned events[BETATEST_PERF_NCOUNTERS][2] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}};
+    for (int i = 0; i < BETATEST_PERF_NCOUNTERS; i++) {
+        if (betatest_perf.fds[i] >= 0) {
+            close(betatest_perf.fds[i]);
+        }
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i][0];
+        attr.config = events[i][1];
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit = 1; /* include threads the test starts */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        betatest_perf.fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1,
+                                            -1, PERF_FLAG_FD_CLOEXEC);
+        if (betatest_perf.fds[i] >= 0) {
+            betatest_perf.available++;
+        }
+    }
+#endif
+    return betatest_perf.available;
+}
+
+/* Whether tests and benchmarks should be measured */
+BETATEST_FUNC int betatest_perf_wanted(void) {
+    if (betatest_perf.enabled < 0) {
+        const char *env = getenv("BETATEST_PERF");
+        betatest_perf.enabled = env != NULL && *env && strcmp(env, "0") != 0;
+    }
+    if (betatest_perf.enabled && betatest_perf_open() == 0) {
+        fprintf(stderr, "betatest: perf_event_open is not permitted, "
+                        "performance counters are off\n");
+        betatest_perf.enabled = 0;
+    }
+    return betatest_perf.enabled;
+}
+
+BETATEST_FUNC void betatest_perf_begin(betatest_perf_mark *mark) {
+    for (int i = 0; i < BETATEST_PERF_NCOUNTERS; i++) {
+        if (betatest_perf.fds[i] < 0 ||
+            read(betatest_perf.fds[i], mark->raw[i], sizeof(mark->raw[i])) !=
+                (ssize_t)sizeof(mark->raw[i])) {
+            memset(mark->raw[i], 0, sizeof(mark->raw[i]));
+        }
+    }
+}
+
+/* Counts since betatest_perf_begin, scaled up if the kernel had to
+ * multiplex the counters */
+BETATEST_FUNC void betatest_perf_end(const betatest_perf_mark *mark,
+                                     betatest_perf_values *values) {
+    for (int i = 0; i < BETATEST_PERF_NCOUNTERS; i++) {
+        unsigned long long now[3];
+        values->values[i] = NAN;
+        if (betatest_perf.fds[i] < 0 ||
+            read(betatest_perf.fds[i], now, sizeof(now)) !=
+                (ssize_t)sizeof(now)) {
+            continue;
+        }
+        double count = (double)(now[0] - mark->raw[i][0]);
+        double enabled = (double)(now[1] - mark->raw[i][1]);
+        double running = (double)(now[2] - mark->raw[i][2]);
+        if (running > 0.0) {
+            values->values[i] = count * enabled / running;
+        } else if (enabled == 0.0) {
+            values->values[i] = 0.0;
+        }
+    }
+}
+
+/* Print the available counters divided by `ops`, as one [PERF] line */
+BETATEST_FUNC void betatest_print_perf(const char *name,
+                                       const betatest_perf_values *values,
+                                       double ops) {
+    const double *v = values->values;
+    betatest_printf("%s[PERF]%s %s:", BETATEST_COLOR_CYAN,
+                    BETATEST_COLOR_RESET, name);
+    const char *sep = " ";
+    for (int i = 0; i < BETATEST_PERF_NCOUNTERS; i++) {
+        if (isnan(v[i])) {
+            continue;
+        }
+        if (i == BETATEST_PERF_TASK_CLOCK && ops <= 1.0) {
+            betatest_printf("%s%.3f ms %s", sep, v[i] / 1e6,
+                            betatest_perf_name(i));
+        } else if (i == BETATEST_PERF_TASK_CLOCK) {
+            betatest_printf("%s%.4g ns %s", sep, v[i] / ops,
+                            betatest_perf_name(i));
+        } else if (ops <= 1.0) {
+            betatest_printf("%s%.0f %s", sep, v[i], betatest_perf_name(i));
+        } else {
+            betatest_printf("%s%.4g %s", sep, v[i] / ops,
+                            betatest_perf_name(i));
+        }
+        sep = ", ";
+        if (i == BETATEST_PERF_INSTRUCTIONS &&
+            !isnan(v[BETATEST_PERF_CYCLES]) && v[BETATEST_PERF_CYCLES] > 0.0) {
+            betatest_printf(", IPC %.2f",
+                            v[i] / v[BETATEST_PERF_CYCLES]);
+        }
+    }
+    betatest_printf("%s\n", ops > 1.0 ? " per op" : "");
+}
+
+/* Sharding
+ *
+ * BETATEST_TOTAL_SHARDS and BETATEST_SHARD_INDEX (or --total-shards and
+ * --shard-index) split the selected tests between that many processes,
+ * e.g. CI machines. Tests are assigned by a hash of their name, or balanced
+ * by duration when a JSON report of an earlier run is given with
+ * --shard-durations/BETATEST_SHARD_DURATIONS. */
+typedef struct {
+    const char *name;
+    double ms;
+    int shard;
+} betatest_shard_entry;
+
+BETATEST_DATA struct {
+    int index; /* -1 until set */
+    int total; /* 0 when not sharded */
+    int configured;
+    const char *durations_path;
+    int planned;
+    betatest_shard_entry *plan; /* sorted by name */
+    int plan_count;
+    double planned_ms;
+} betatest_shard BETATEST_INIT({-1, 0, 0, NULL, 0, NULL, 0, 0.0});
+
+/* Fill in the shard settings the options left unset from the environment.
+ * Returns -1, after printing why, if they are invalid. */
+BETATEST_FUNC int betatest_shard_configure(void) {
+    if (betatest_shard.configured) {
+        return 0;
+    }
+    betatest_shard.configured = 1;
+    const char *env = getenv("BETATEST_TOTAL_SHARDS");
+    if (betatest_shard.total == 0 && env != NULL) {
+        betatest_shard.total = atoi(env);
+    }
+    env = getenv("BETATEST_SHARD_INDEX");
+    if (betatest_shard.index < 0 && env != NULL) {
+        betatest_shard.index = atoi(env);
+    }
+    if (betatest_shard.index < 0) {
+        betatest_shard.index = 0;
+    }
+    if (betatest_shard.durations_path == NULL) {
+        betatest_shard.durations_path = getenv("BETATEST_SHARD_DURATIONS");
+    }
+    if (betatest_shard.total < 0 ||
+        (betatest_shard.total > 0 &&
+         betatest_shard.index >= betatest_shard.total)) {
+        fprintf(stderr, "betatest: invalid shard index %d for %d shards\n",
+                betatest_shard.index, betatest_shard.total);
+        betatest_shard.total = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Reporters
+ *
+ * The console output above is always produced. On top of it one reporter
+ * can be selected with --reporter=NAME or BETATEST_REPORTER: "json" writes
+ * one JSON object per line, "junit" writes JUnit XML. Records are written
+ * and flushed as each test finishes, so a killed run still leaves the
+ * results of every finished test behind. Output goes to --report-file or
+ * BETATEST_REPORT_FILE; when it goes to stdout the console output moves to
+ * stderr. More reporters can be added with betatest_add_reporter. */
+typedef struct {
+    char *file;
+    int line;
+    char *message;
+} betatest_failure;
+
+/* Failures of the running test, guarded by betatest_output.lock */
+BETATEST_DATA struct {
+    betatest_failure *items;
+    int count;
+    int cap;
+    int dropped;
+} betatest_failures BETATEST_INIT({NULL, 0, 0, 0});
+
+enum {
+    BETATEST_STATUS_PASSED,
+    BETATEST_STATUS_FAILED,
+    BETATEST_STATUS_TIMED_OUT
+};
+
+typedef struct {
+    const char *name;
+    int status;
+    long long wall_ns;
+    long long cpu_ns;
+    int assertions_run;
+    int assertions_passed;
+    int assertions_failed;
+    betatest_alloc_stats allocs; /* zero unless BETATEST_TRACK_ALLOCS */
+    const betatest_perf_values *perf; /* NULL unless measured */
+    const betatest_failure *failures;
+    int nfailures;
+} betatest_report;
+
+typedef struct {
+    const char *name;
+    void (*begin)(FILE *out);
+    void (*test)(FILE *out, const betatest_report *report);
+    void (*end)(FILE *out);
+} betatest_reporter;
+
+BETATEST_DATA struct {
+    const char *name;
+    const char *path;
+    const betatest_reporter *reporter;
+    FILE *out;
+    int opened;
+    int in_worker; /* parallel workers leave reporting to the parent */
+    const betatest_reporter *custom[8];
+    int ncustom;
+} betatest_reporting BETATEST_INIT({NULL, NULL, NULL, NULL, 0, 0, {NULL}, 0});
+
+BETATEST_FUNC const char *betatest_status_name(int status) {
+    switch (status) {
+    case BETATEST_STATUS_PASSED:
+        return "passed";
+    case BETATEST_STATUS_TIMED_OUT:
+        return "timeout";
+    default:
+        return "failed";
+    }
+}
+
+/* Keep a copy of a failure message for the reporters */
+BETATEST_FUNC void betatest_capture_failure(const char *file, int line,
+                                            const char *message) {
+    if (betatest_failures.count >= BETATEST_REPORT_MAX_FAILURES ||
+        betatest_grow(&betatest_failures.items, &betatest_failures.cap,
+                      betatest_failures.count, sizeof(betatest_failure)) != 0) {
+        betatest_failures.dropped++;
+        return;
+    }
+    betatest_failure *f = &betatest_failures.items[betatest_failures.count];
+    f->file = strdup(file);
+    f->message = strdup(message);
+    f->line = line;
+    if (f->file == NULL || f->message == NULL) {
+        free(f->file);
+        free(f->message);
+        betatest_failures.dropped++;
+        return;
+    }
+    betatest_failures.count++;
+}
+
+BETATEST_FUNC void betatest_clear_failures(void) {
+    for (int i = 0; i < betatest_failures.count; i++) {
+        free(betatest_failures.items[i].file);
+        free(betatest_failures.items[i].message);
+    }
+    betatest_failures.count = 0;
+    betatest_failures.dropped = 0;
+}
+
+BETATEST_FUNC void betatest_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c == '\t') {
+            fputs("\\t", out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+BETATEST_FUNC void betatest_json_test(FILE *out, const betatest_report *r) {
+    fputs("{\"type\":\"test\",\"name\":", out);
+    betatest_json_string(out, r->name);
+    fprintf(out,
+            ",\"status\":\"%s\",\"wall_ms\":%.6f,\"cpu_ms\":%.6f,"
+            "\"assertions\":{\"run\":%d,\"passed\":%d,\"failed\":%d},",
+            betatest_status_name(r->status), (double)r->wall_ns / 1e6,
+            (double)r->cpu_ns / 1e6, r->assertions_run, r->assertions_passed,
+            r->assertions_failed);
+    if (BETATEST_ALLOCS_TRACKED) {
+        fprintf(out,
+                "\"allocations\":{\"count\":%ld,\"bytes\":%ld,"
+                "\"peak_bytes\":%ld,\"leaked_blocks\":%ld,"
+                "\"leaked_bytes\":%ld},",
+                r->allocs.allocs, r->allocs.bytes, r->allocs.peak_bytes,
+                r->allocs.leaked_blocks, r->allocs.leaked_bytes);
+    }
+    if (r->perf != NULL) {
+        fputs("\"perf\":{", out);
+        const char *sep = "";
+        for (int i = 0; i < BETATEST_PERF_NCOUNTERS; i++) {
+            if (!isnan(r->perf->values[i])) {
+                fprintf(out, "%s\"%s\":%.0f", sep, betatest_perf_name(i),
+                        r->perf->values[i]);
+                sep = ",";
+            }
+        }
+        fputs("},", out);
+    }
+    fputs("\"failures\":[", out);
+    for (int i = 0; i < r->nfailures; i++) {
+        fputs(i ? ",{\"file\":" : "{\"file\":", out);
+        betatest_json_string(out, r->failures[i].file);
+        fprintf(out, ",\"line\":%d,\"message\":", r->failures[i].line);
+        betatest_json_string(out, r->failures[i].message);
+        fputc('}', out);
+    }
+    fputs("]}\n", out);
+}
+
+BETATEST_FUNC void betatest_json_end(FILE *out) {
+    fprintf(out,
+            "{\"type\":\"summary\",\"tests\":{\"run\":%d,\"passed\":%d,"
+            "\"failed\":%d,\"timed_out\":%d},\"assertions\":{\"run\":%d,"
+            "\"passed\":%d,\"failed\":%d}",
+            betatest_stats.tests_run, betatest_stats.tests_passed,
+            betatest_stats.tests_failed, betatest_stats.tests_timed_out,
+            betatest_stats.assertions_run, betatest_stats.assertions_passed,
+            betatest_stats.assertions_failed);
+    if (betatest_shard.total > 0) {
+        fprintf(out, ",\"shard\":{\"index\":%d,\"total\":%d}",
+                betatest_shard.index, betatest_shard.total);
+    }
+    fputs("}\n", out);
+}
+
+BETATEST_FUNC void betatest_xml_string(FILE *out, const char *s) {
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        switch (c) {
+        case '&':
+            fputs("&amp;", out);
+            break;
+        case '<':
+            fputs("&lt;", out);
+            break;
+        case '>':
+            fputs("&gt;", out);
+            break;
+        case '"':
+            fputs("&quot;", out);
+            break;
+        case '\'':
+            fputs("&apos;", out);
+            break;
+        default:
+            /* Control characters other than tab and newline are not XML */
+            fputc(c < 0x20 && c != '\n' && c != '\t' ? '?' : c, out);
+        }
+    }
+}
+
+BETATEST_FUNC void betatest_junit_begin(FILE *out) {
+    fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n"
+          "  <testsuite name=\"betatest\">\n",
+          out);
+    betatest_shard_configure();
+    if (betatest_shard.total > 0) {
+        fprintf(out,
+                "    <properties>\n"
+                "      <property name=\"shard_index\" value=\"%d\"/>\n"
+                "      <property name=\"total_shards\" value=\"%d\"/>\n"
+                "    </properties>\n",
+                betatest_shard.index, betatest_shard.total);
+    }
+}
+
+BETATEST_FUNC void betatest_junit_test(FILE *out, const betatest_report *r) {
+    fputs("    <testcase classname=\"betatest\" name=\"", out);
+    betatest_xml_string(out, r->name);
+    fprintf(out, "\" time=\"%.6f\" assertions=\"%d\"", (double)r->wall_ns / 1e9,
+            r->assertions_run);
+    if (r->status == BETATEST_STATUS_PASSED) {
+        fputs("/>\n", out);
+        return;
+    }
+    fputs(">\n", out);
+    for (int i = 0; i < r->nfailures; i++) {
+        fprintf(out, "      <failure type=\"%s\" message=\"",
+                r->status == BETATEST_STATUS_FAILED
+                    ? "assertion"
+                    : betatest_status_name(r->status));
+        betatest_xml_string(out, r->failures[i].message);
+        fputs("\">", out);
+        betatest_xml_string(out, r->failures[i].file);
+        fprintf(out, ":%d: ", r->failures[i].line);
+        betatest_xml_string(out, r->failures[i].message);
+        fputs("</failure>\n", out);
+    }
+    if (r->nfailures == 0) {
+        fprintf(out, "      <failure type=\"%s\"/>\n",
+                betatest_status_name(r->status));
+    }
+    fputs("    </testcase>\n", out);
+}
+
+BETATEST_FUNC void betatest_junit_end(FILE *out) {
+    fputs("  </testsuite>\n</testsuites>\n", out);
+}
+
+static const betatest_reporter betatest_json_reporter = {
+    "json", NULL, betatest_json_test, betatest_json_end};
+
+static const betatest_reporter betatest_junit_reporter = {
+    "junit", betatest_junit_begin, betatest_junit_test, betatest_junit_end};
+
+/* Make a custom reporter selectable by name with --reporter */
+BETATEST_FUNC void betatest_add_reporter(const betatest_reporter *reporter) {
+    if (betatest_reporting.ncustom < 8) {
+        betatest_reporting.custom[betatest_reporting.ncustom++] = reporter;
+    }
+}
+
+/* Resolve the selected reporter and open its output, once */
+BETATEST_FUNC void betatest_reporter_open(void) {
+    if (betatest_reporting.opened) {
+        return;
+    }
+    betatest_reporting.opened = 1;
+    const char *name = betatest_reporting.name ? betatest_reporting.name
+                                               : getenv("BETATEST_REPORTER");
+    const char *path = betatest_reporting.path ? betatest_reporting.path
+                                               : getenv("BETATEST_REPORT_FILE");
+    if (name == NULL || *name == '\0' || strcmp(name, "console") == 0) {
+        return;
+    }
+    const betatest_reporter *reporter = NULL;
+    if (strcmp(name, "json") == 0) {
+        reporter = &betatest_json_reporter;
+    } else if (strcmp(name, "junit") == 0) {
+        reporter = &betatest_junit_reporter;
+    }
+    for (int i = 0; reporter == NULL && i < betatest_reporting.ncustom; i++) {
+        if (strcmp(name, betatest_reporting.custom[i]->name) == 0) {
+            reporter = betatest_reporting.custom[i];
+        }
+    }
+    if (reporter == NULL) {
+        fprintf(stderr, "betatest: unknown reporter '%s', using console\n",
+                name);
+        return;
+    }
+    FILE *out = stdout;
+    if (path != NULL && *path != '\0' && strcmp(path, "-") != 0) {
+        out = fopen(path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "betatest: cannot open report file '%s': %s\n",
+                    path, strerror(errno));
+            return;
+        }
+    } else {
+        betatest_output.fd = STDERR_FILENO;
+    }
+    betatest_reporting.reporter = reporter;
+    betatest_reporting.out = out;
+    if (reporter->begin) {
+        reporter->begin(out);
+        fflush(out);
+    }
+}
+
+BETATEST_FUNC void betatest_report_test(const betatest_report *report) {
+    if (betatest_reporting.in_worker) {
+        return;
+    }
+    betatest_reporter_open();
+    if (betatest_reporting.reporter != NULL) {
+        betatest_reporting.reporter->test(betatest_reporting.out, report);
+        fflush(betatest_reporting.out);
+    }
+}
+
+BETATEST_FUNC void betatest_report_end(void) {
+    if (betatest_reporting.reporter != NULL) {
+        if (betatest_reporting.reporter->end) {
+            betatest_reporting.reporter->end(betatest_reporting.out);
+        }
+        fflush(betatest_reporting.out);
+    }
+}
+
+/* Assertion helpers
+ *
+ * Safe to use from any thread; the counts land in betatest_stats when the
+ * test ends, and a failure report is appended to the output arena in one
+ * piece so reports from different threads do not interleave. */
+
+/* Index of the running TEST_P case, -1 outside one */
+BETATEST_DATA long betatest_case_index BETATEST_INIT(-1);
+
+BETATEST_COLD __attribute__((format(printf, 3, 4))) void
+betatest_fail(const char *file, int line, const char *fmt, ...) {
+    betatest_counters *counters = betatest_thread_counters();
+    __atomic_store_n(&counters->failed, counters->failed + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&betatest_stats.current_test_failed, 1,
+                     __ATOMIC_RELAXED);
+    betatest_note_site(file, line);
+
+    char buf[512];
+    char *message = buf;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    betatest_untracked++;
+    if (n >= (int)sizeof(buf)) {
+        message = (char *)malloc((size_t)n + 1);
+        if (message != NULL) {
+            va_start(ap, fmt);
+            vsnprintf(message, (size_t)n + 1, fmt, ap);
+            va_end(ap);
+        } else {
+            message = buf;
+        }
+    }
+
+    betatest_lock(&betatest_output.lock);
+    betatest_capture_failure(file, line, message);
+    if (BETATEST_DO_PRINT_FAIL) {
+        char where[32] = "";
+        if (betatest_case_index >= 0) {
+            snprintf(where, sizeof(where), ", case %ld", betatest_case_index);
+        }
+        betatest_append("%s[FAIL]%s %s\n       %s\n       at %s:%d%s\n",
+                        BETATEST_COLOR_RED, BETATEST_COLOR_RESET,
+                        betatest_stats.current_test_name, message, file, line,
+                        where);
+    }
+    betatest_unlock(&betatest_output.lock);
+    if (message != buf) {
+        free(message);
+    }
+    betatest_untracked--;
+}
+
+static inline void betatest_pass(const betatest_site *site) {
+    betatest_counters *counters = betatest_thread_counters();
+    __atomic_store_n(&counters->passed, counters->passed + 1,
+                     __ATOMIC_RELAXED);
+    betatest_last_site = site;
+}
+
+/* First assertion on a thread: attach its counters, then count the pass */
+BETATEST_COLD void betatest_pass_slow(const betatest_site *site) {
+    betatest_pass(site);
+}
+
+#define BETATEST_RECORD_PASS()                                                 \
+    do {                                                                       \
+        static const betatest_site _betatest_site = {__FILE__, __LINE__};      \
+        betatest_pass(&_betatest_site);                                        \
+    } while (0)
+
+/* Evaluate `ok` once; count a pass or run the failure statement. Optimised
+ * builds inline the pass path as a predicted branch (on `ok` and this
+ * thread's counters both being there) and a counter increment; unoptimised
+ * builds call out for it, which keeps them small. */
+#ifdef __OPTIMIZE__
+#define BETATEST_CHECK(ok, ...)                                                \
+    do {                                                                       \
+        static const betatest_site _betatest_site = {__FILE__, __LINE__};      \
+        betatest_counters *_betatest_counters = betatest_thread_block;         \
+        int _betatest_ok = (ok) ? 1 : 0;                                       \
+        if (BETATEST_LIKELY(_betatest_ok & (_betatest_counters != NULL))) {    \
+            __atomic_store_n(&_betatest_counters->passed,                      \
+                             _betatest_counters->passed + 1,                   \
+                             __ATOMIC_RELAXED);                                \
+            betatest_last_site = &_betatest_site;                              \
+        } else if (_betatest_ok) {                                             \
+            betatest_pass_slow(&_betatest_site);                               \
+        } else {                                                               \
+            __VA_ARGS__;                                                       \
+        }                                                                      \
+    } while (0)
+#else
+#define BETATEST_CHECK(ok, ...)                                                \
+    do {                                                                       \
+        static const betatest_site _betatest_site = {__FILE__, __LINE__};      \
+        if (ok) {                                                              \
+            betatest_pass(&_betatest_site);                                    \
+        } else {                                                               \
+            __VA_ARGS__;                                                       \
+        }                                                                      \
+    } while (0)
+#endif
+
+#define BETATEST_RECORD_FAIL(msg, ...)                                         \
+    betatest_fail(__FILE__, __LINE__, msg, ##__VA_ARGS__)
+
+/* Failure reports shared by the assertion macros. Each assertion passes its
+ * values and stringified expressions here instead of expanding its own
+ * format string and printf call, so the inlined code at every assertion is
+ * just the check, a predicted branch and a counter increment. */
+BETATEST_COLD void betatest_fail_msg(const char *file, int line,
+                                     const char *what) {
+    betatest_fail(file, line, "Assertion failed: %s", what);
+}
+
+BETATEST_COLD void betatest_fail_expr(const char *file, int line,
+                                      const char *what, const char *expr) {
+    betatest_fail(file, line,
+                  "Assertion failed: %s\n"
+                  "       Expression: %s",
+                  what, expr);
+}
+
+/* Two labelled integers, or one ("Both") when expr_b is NULL */
+BETATEST_COLD void betatest_fail_int(const char *file, int line,
+                                     const char *what, const char *expr_a,
+                                     long long a, const char *expr_b,
+                                     long long b) {
+    if (expr_b == NULL) {
+        betatest_fail(file, line,
+                      "Assertion failed: %s\n"
+                      "       Both: %lld",
+                      what, a);
+        return;
+    }
+    betatest_fail(file, line,
+                  "Assertion failed: %s\n"
+                  "       1:  %s = %lld\n"
+                  "       2:  %s = %lld",
+                  what, expr_a, a, expr_b, b);
+}
+
+/* Up to two labelled strings: "<label><expr> = "<value>"". A NULL expr
+ * leaves out the "<expr> = " part, a NULL label the whole line, and a NULL
+ * value prints as NULL. */
+BETATEST_COLD void betatest_fail_str(const char *file, int line,
+                                     const char *what, const char *label_a,
+                                     const char *expr_a, const char *a,
+                                     const char *label_b, const char *expr_b,
+                                     const char *b) {
+    char lines[2][512];
+    const char *labels[2] = {label_a, label_b};
+    const char *exprs[2] = {expr_a, expr_b};
+    const char *values[2] = {a, b};
+    for (int i = 0; i < 2; i++) {
+        lines[i][0] = '\0';
+        if (labels[i] == NULL) {
+            continue;
+        }
+        snprintf(lines[i], sizeof(lines[i]), "\n       %s%s%s%s%s%s",
+                 labels[i], exprs[i] ? exprs[i] : "", exprs[i] ? " = " : "",
+                 values[i] ? "\"" : "", values[i] ? values[i] : "NULL",
+                 values[i] ? "\"" : "");
+    }
+    betatest_fail(file, line, "Assertion failed: %s%s%s", what, lines[0],
+                  lines[1]);
+}
+
+BETATEST_COLD void betatest_fail_float(const char *file, int line,
+                                       const char *expr_a, double a,
+                                       const char *expr_b, double b,
+                                       double epsilon) {
+    betatest_fail(file, line,
+                  "Assertion failed: floats not equal within epsilon\n"
+                  "       Got:      %s = %.10g\n"
+                  "       Expected: %s = %.10g\n"
+                  "       Epsilon:  %.10g\n"
+                  "       Diff:     %.10g",
+                  expr_a, a, expr_b, b, epsilon, fabs(a - b));
+}
+
+/* Test timeout meaning "use --timeout or BETATEST_TIMEOUT_MS" */
+#define BETATEST_TIMEOUT_DEFAULT (-1)
+
+BETATEST_FUNC void *betatest_watchdog_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&betatest_watchdog.lock);
+    for (;;) {
+        long long deadline = betatest_watchdog.deadline_ns;
+        if (deadline == 0) {
+            pthread_cond_wait(&betatest_watchdog.cond, &betatest_watchdog.lock);
+            continue;
+        }
+        struct timespec ts;
+        ts.tv_sec = (time_t)(deadline / 1000000000LL);
+        ts.tv_nsec = (long)(deadline % 1000000000LL);
+        pthread_cond_timedwait(&betatest_watchdog.cond,
+                               &betatest_watchdog.lock, &ts);
+        if (betatest_watchdog.deadline_ns == deadline &&
+            betatest_clock_ns(CLOCK_MONOTONIC) >= deadline) {
+            betatest_watchdog.deadline_ns = 0;
+            pthread_kill(betatest_watchdog.runner, BETATEST_TIMEOUT_SIGNAL);
+        }
+    }
+    return NULL;
+}
+
+/* Start the watchdog thread, again after a fork since it does not survive */
+BETATEST_FUNC int betatest_watchdog_start(void) {
+    if (betatest_watchdog.pid == getpid()) {
+        return 0;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&betatest_watchdog.lock, NULL);
+    pthread_cond_init(&betatest_watchdog.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = betatest_timeout_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(BETATEST_TIMEOUT_SIGNAL, &sa, NULL);
+
+    /* The watchdog itself must never take the signal */
+    sigset_t block;
+    sigset_t old;
+    sigemptyset(&block);
+    sigaddset(&block, BETATEST_TIMEOUT_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, betatest_watchdog_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    betatest_watchdog.pid = getpid();
+    return 0;
+}
+
+/* Timeout in ms for a test registered with `timeout_ms` (0 = none) */
+BETATEST_FUNC int betatest_timeout_ms(int timeout_ms) {
+    static int env_ms = -2;
+    if (timeout_ms != BETATEST_TIMEOUT_DEFAULT) {
+        return timeout_ms > 0 ? timeout_ms : 0;
+    }
+    if (betatest_watchdog.default_ms >= 0) {
+        return betatest_watchdog.default_ms;
+    }
+    if (env_ms == -2) {
+        const char *env = getenv("BETATEST_TIMEOUT_MS");
+        env_ms = env ? atoi(env) : BETATEST_TIMEOUT_MS;
+    }
+    return env_ms > 0 ? env_ms : 0;
+}
+
+/* Crash recovery
+ *
+ * With --catch-crashes a test that raises SIGSEGV, SIGBUS, SIGFPE, SIGILL or
+ * SIGABRT is reported as failed instead of killing the binary. The handlers
+ * run on an alternate stack, so a stack overflow is caught too, and jump
+ * back to the runner the same way a timeout does. The crash may have left
+ * the heap or a C library lock broken, so the process then stops running
+ * tests like it does after a timeout, and only reports the summary. A
+ * crash on another thread or inside a framework lock still ends the
+ * process. */
+BETATEST_DATA struct {
+    int enabled;                  /* --catch-crashes, -1 when not given */
+    int installed;                /* handlers and stack are in place */
+    volatile sig_atomic_t signal; /* what the last call crashed with, or 0 */
+    pid_t child;                  /* ASSERT_DEATH child being waited for */
+} betatest_crash BETATEST_INIT({-1, 0, 0, 0});
+
+BETATEST_DATA __thread volatile sig_atomic_t
+    betatest_crash_armed BETATEST_INIT(0);
+
+static const int betatest_crash_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL,
+                                             SIGABRT};
+
+BETATEST_FUNC void betatest_crash_handler(int sig) {
+    if (betatest_crash_armed && betatest_locks_held == 0) {
+        betatest_crash_armed = 0;
+        betatest_watchdog.armed = 0;
+        betatest_crash.signal = sig;
+        siglongjmp(betatest_call_jump, 1);
+    }
+    /* Not recoverable: die the way the signal would have made us */
+    signal(sig, SIG_DFL);
+    betatest_crash_flush(sig);
+    raise(sig);
+}
+
+/* Install the crash handlers over the output hooks, leaving user handlers
+ * alone. The alternate stack belongs to the calling thread, the runner. */
+BETATEST_FUNC void betatest_crash_install(void) {
+    betatest_crash.installed = 1;
+    stack_t ss;
+    memset(&ss, 0, sizeof(ss));
+    betatest_untracked++;
+    ss.ss_sp = malloc(BETATEST_CRASH_STACK_SIZE);
+    betatest_untracked--;
+    ss.ss_size = BETATEST_CRASH_STACK_SIZE;
+    int flags = SA_NODEFER;
+    if (ss.ss_sp != NULL && sigaltstack(&ss, NULL) == 0) {
+        flags |= SA_ONSTACK;
+    }
+    for (size_t i = 0; i < sizeof(betatest_crash_signals) /
+                               sizeof(betatest_crash_signals[0]);
+         i++) {
+        struct sigaction old;
+        if (sigaction(betatest_crash_signals[i], NULL, &old) == 0 &&
+            (old.sa_handler == SIG_DFL ||
+             old.sa_handler == betatest_crash_flush)) {
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = betatest_crash_handler;
+            sa.sa_flags = flags;
+            sigemptyset(&sa.sa_mask);
+            sigaction(betatest_crash_signals[i], &sa, NULL);
+        }
+    }
+}
+
+/* Whether crashes are caught, installing the handlers the first time */
+BETATEST_FUNC int betatest_crash_catching(void) {
+    if (betatest_crash.enabled < 0) {
+        const char *env = getenv("BETATEST_CATCH_CRASHES");
+        betatest_crash.enabled =
+            env ? atoi(env) != 0 : BETATEST_CATCH_CRASHES != 0;
+    }
+    if (betatest_crash.enabled && !betatest_crash.installed) {
+        betatest_crash_install();
+    }
+    return betatest_crash.enabled;
+}
+
+BETATEST_FUNC const char *betatest_signal_name(int sig) {
+    switch (sig) {
+    case SIGSEGV:
+        return "SIGSEGV";
+    case SIGBUS:
+        return "SIGBUS";
+    case SIGFPE:
+        return "SIGFPE";
+    case SIGILL:
+        return "SIGILL";
+    case SIGABRT:
+        return "SIGABRT";
+    case SIGKILL:
+        return "SIGKILL";
+    case SIGTERM:
+        return "SIGTERM";
+    default:
+        return "signal";
+    }
+}
+
+/* Run fn under the watchdog and the crash handlers. Returns 1 if it timed
+ * out or crashed; betatest_crash.signal is set in the second case. */
+BETATEST_FUNC int betatest_call_with_timeout(betatest_fn fn, int timeout_ms) {
+    betatest_untracked++;
+    int started = timeout_ms > 0 && betatest_watchdog_start() == 0;
+    int catching = betatest_crash_catching();
+    betatest_untracked--;
+    if (!started && !catching) {
+        fn();
+        return 0;
+    }
+    /* The crash handlers do not block their signal, so only the watchdog
+     * needs the mask restored */
+    if (sigsetjmp(betatest_call_jump, started) != 0) {
+        /* The jump may have left a framework section half way */
+        betatest_untracked = 0;
+        betatest_interrupted = 1;
+        if (betatest_crash.child > 0) {
+            kill(betatest_crash.child, SIGKILL);
+            waitpid(betatest_crash.child, NULL, 0);
+            betatest_crash.child = 0;
+        }
+        if (started && betatest_crash.signal != 0) {
+            betatest_lock(&betatest_watchdog.lock);
+            betatest_watchdog.deadline_ns = 0;
+            betatest_unlock(&betatest_watchdog.lock);
+        }
+        return 1;
+    }
+    if (started) {
+        betatest_lock(&betatest_watchdog.lock);
+        betatest_watchdog.runner = pthread_self();
+        betatest_watchdog.deadline_ns = betatest_clock_ns(CLOCK_MONOTONIC) +
+                                        (long long)timeout_ms * 1000000LL;
+        betatest_watchdog.armed = 1;
+        pthread_cond_signal(&betatest_watchdog.cond);
+        betatest_unlock(&betatest_watchdog.lock);
+    }
+    betatest_crash_armed = catching;
+    fn();
+    betatest_crash_armed = 0;
+    if (started) {
+        betatest_lock(&betatest_watchdog.lock);
+        betatest_watchdog.armed = 0;
+        betatest_watchdog.deadline_ns = 0;
+        betatest_unlock(&betatest_watchdog.lock);
+    }
+    return 0;
+}
+
+/* Suites
+ *
+ * SUITE groups tests under a shared name with optional fixture hooks. The
+ * suite setup runs lazily, right before the first selected test of the suite,
+ * so a filtered run never pays for a fixture it does not use. Its teardown
+ * runs once the last selected test of the suite has finished, or from
+ * TEST_SUMMARY (and at worker exit) when that is not known in advance. The
+ * per-test SETUP and TEARDOWN wrap every test body, and TEARDOWN runs even if
+ * the body failed or timed out. */
+typedef struct betatest_suite {
+    const char *name;
+    betatest_fn setup;
+    betatest_fn teardown;
+    betatest_fn suite_setup;
+    betatest_fn suite_teardown;
+    int ready;   /* suite_setup has run, suite_teardown has not */
+    pid_t owner; /* process that ran suite_setup */
+    int pending; /* selected tests left to run, 0 = unknown */
+    struct betatest_suite *next_ready;
+} betatest_suite;
+
+BETATEST_DATA betatest_suite *betatest_ready_suites BETATEST_INIT(NULL);
+
+/* Cases of a TEST_P: an array of records, either static (TEST_P_ARRAY),
+ * a memory-mapped binary file (TEST_P_FILE) or the lines of a memory-mapped
+ * text file parsed one at a time (TEST_P_CSV). */
+typedef struct betatest_params {
+    size_t size; /* sizeof the parameter type */
+    void (*call)(const void *param, size_t index);
+    const void *array;
+    size_t count;
+    const char *path;
+    int (*parse)(const char *line, void *out);
+    int loaded; /* 0 = not yet, 1 = loaded, -1 = failed */
+    char error[256];
+    void *map;
+    size_t map_len;
+    size_t *lines; /* TEST_P_CSV: offset of each record line */
+    char *line_buf;
+    int line_cap;
+    void *record; /* TEST_P_CSV: the parsed record */
+    struct betatest_test_s *cases;
+    size_t ncases;
+} betatest_params;
+
+typedef struct betatest_test_s {
+    const char *name;
+    betatest_fn fn;
+    const char *file;
+    int line;
+    int timeout_ms;
+    betatest_suite *suite;    /* NULL for a plain TEST */
+    betatest_params *params;  /* TEST_P and its cases */
+    size_t case_index;
+} betatest_test;
+
+/* Run the suite setup if it has not run yet. Returns 1 if it timed out. */
+BETATEST_FUNC int betatest_suite_enter(betatest_suite *suite, int timeout_ms) {
+    if (suite->ready) {
+        return 0;
+    }
+    suite->ready = 1;
+    suite->owner = getpid();
+    suite->next_ready = betatest_ready_suites;
+    betatest_ready_suites = suite;
+    if (suite->suite_setup == NULL) {
+        return 0;
+    }
+    return betatest_call_with_timeout(suite->suite_setup, timeout_ms);
+}
+
+/* Run the suite teardown, if this process ran the suite setup */
+BETATEST_FUNC void betatest_suite_leave(betatest_suite *suite) {
+    if (!suite->ready || suite->owner != getpid() || betatest_interrupted) {
+        return;
+    }
+    suite->ready = 0;
+    for (betatest_suite **p = &betatest_ready_suites; *p != NULL;
+         p = &(*p)->next_ready) {
+        if (*p == suite) {
+            *p = suite->next_ready;
+            break;
+        }
+    }
+    if (suite->suite_teardown == NULL) {
+        return;
+    }
+    int timeout_ms = betatest_timeout_ms(BETATEST_TIMEOUT_DEFAULT);
+    betatest_crash.signal = 0;
+    if (betatest_call_with_timeout(suite->suite_teardown, timeout_ms)) {
+        if (betatest_crash.signal != 0) {
+            betatest_printf("%s[CRASH]%s suite teardown of %s with %s\n\n",
+                            BETATEST_COLOR_RED, BETATEST_COLOR_RESET,
+                            suite->name,
+                            betatest_signal_name(betatest_crash.signal));
+        } else {
+            betatest_printf("%s[TIMEOUT]%s suite teardown of %s after %d "
+                            "ms\n\n",
+                            BETATEST_COLOR_RED, BETATEST_COLOR_RESET,
+                            suite->name, timeout_ms);
+        }
+    }
+}
+
+/* Tear down every suite this process has set up, newest first */
+BETATEST_FUNC void betatest_suites_leave_all(void) {
+    betatest_suite **p = &betatest_ready_suites;
+    while (*p != NULL) {
+        if ((*p)->owner == getpid()) {
+            betatest_suite_leave(*p);
+        } else {
+            p = &(*p)->next_ready;
+        }
+    }
+}
+
+/* Map the vector file of a TEST_P and count its cases. Returns 1 on
+ * success and -1 with params->error set on failure. */
+BETATEST_FUNC int betatest_params_load(betatest_params *params) {
+    if (params->loaded != 0) {
+        return params->loaded;
+    }
+    params->loaded = -1;
+    if (params->path == NULL) {
+        if (params->array == NULL) {
+            snprintf(params->error, sizeof(params->error),
+                     "no TEST_P_ARRAY, TEST_P_FILE or TEST_P_CSV source");
+            return -1;
+        }
+        params->loaded = 1;
+        return 1;
+    }
+    int fd = open(params->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        snprintf(params->error, sizeof(params->error), "%s: %s",
+                 params->path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    params->map_len = (size_t)st.st_size;
+    if (params->map_len > 0) {
+        params->map =
+            mmap(NULL, params->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (params->map == MAP_FAILED) {
+        params->map = NULL;
+        snprintf(params->error, sizeof(params->error), "%s: %s",
+                 params->path, strerror(errno));
+        return -1;
+    }
+    const char *data = (const char *)params->map;
+    if (params->parse == NULL) {
+        if (params->map_len % params->size != 0) {
+            snprintf(params->error, sizeof(params->error),
+                     "%s: %zu bytes is not a multiple of the %zu byte "
+                     "record size",
+                     params->path, params->map_len, params->size);
+            return -1;
+        }
+        params->array = data;
+        params->count = params->map_len / params->size;
+        params->loaded = 1;
+        return 1;
+    }
+    /* One case per line, skipping blank lines and '#' comments */
+    size_t cap = 0;
+    for (size_t pos = 0; pos < params->map_len;) {
+        const char *nl = (const char *)memchr(data + pos, '\n',
+                                              params->map_len - pos);
+        size_t end = nl ? (size_t)(nl - data) : params->map_len;
+        if (end > pos && data[pos] != '#' && data[pos] != '\r') {
+            if (params->count == cap) {
+                cap = cap ? cap * 2 : 1024;
+                size_t *grown = (size_t *)realloc(params->lines,
+                                                  cap * sizeof(size_t));
+                if (grown == NULL) {
+                    snprintf(params->error, sizeof(params->error),
+                             "out of memory");
+                    return -1;
+                }
+                params->lines = grown;
+            }
+            params->lines[params->count++] = pos;
+        }
+        pos = end + 1;
+    }
+    params->record = malloc(params->size);
+    if (params->record == NULL) {
+        snprintf(params->error, sizeof(params->error), "out of memory");
+        return -1;
+    }
+    params->loaded = 1;
+    return 1;
+}
+
+/* The running TEST_P case, read by betatest_case_main */
+BETATEST_DATA const betatest_test *betatest_current_case BETATEST_INIT(NULL);
+
+/* Body of every TEST_P case: find its record and call the test with it */
+BETATEST_FUNC void betatest_case_main(void) {
+    const betatest_test *test = betatest_current_case;
+    betatest_params *params = test->params;
+    if (params->loaded < 0) {
+        betatest_fail(test->file, test->line, "Cannot load the cases: %s",
+                      params->error);
+        return;
+    }
+    size_t index = test->case_index;
+    if (params->parse == NULL) {
+        params->call((const char *)params->array + index * params->size,
+                     index);
+        return;
+    }
+    const char *line = (const char *)params->map + params->lines[index];
+    size_t rest = params->map_len - params->lines[index];
+    const char *nl = (const char *)memchr(line, '\n', rest);
+    size_t len = nl ? (size_t)(nl - line) : rest;
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    /* Room for the line and its terminator; a long line may need the
+     * buffer doubled more than once */
+    int grown = 0;
+    betatest_untracked++;
+    while (grown == 0 && len >= (size_t)params->line_cap) {
+        grown = betatest_grow(&params->line_buf, &params->line_cap, (int)len,
+                              1);
+    }
+    betatest_untracked--;
+    if (grown != 0) {
+        betatest_fail(test->file, test->line, "Out of memory");
+        return;
+    }
+    memcpy(params->line_buf, line, len);
+    params->line_buf[len] = '\0';
+    memset(params->record, 0, params->size);
+    if (params->parse(params->line_buf, params->record) != 0) {
+        betatest_fail(test->file, test->line, "Cannot parse case %zu of %s: %s",
+                      index, params->path, params->line_buf);
+        return;
+    }
+    params->call(params->record, index);
+}
+
+/* Run a test body between the SETUP and TEARDOWN hooks of its suite.
+ * Returns 1 if any of them timed out or crashed. */
+BETATEST_FUNC int betatest_call_test(const betatest_test *test,
+                                     int timeout_ms) {
+    betatest_current_case = test;
+    betatest_case_index =
+        test->params && test->params->loaded > 0 ? (long)test->case_index : -1;
+    betatest_suite *suite = test->suite;
+    if (suite == NULL) {
+        int timed_out = betatest_call_with_timeout(test->fn, timeout_ms);
+        betatest_case_index = -1;
+        return timed_out;
+    }
+    int timed_out = 0;
+    if (suite->setup != NULL) {
+        timed_out = betatest_call_with_timeout(suite->setup, timeout_ms);
+    }
+    if (!timed_out) {
+        timed_out = betatest_call_with_timeout(test->fn, timeout_ms);
+    }
+    if (suite->teardown != NULL && !betatest_interrupted) {
+        timed_out |= betatest_call_with_timeout(suite->teardown, timeout_ms);
+    }
+    betatest_case_index = -1;
+    return timed_out;
+}
+
+/* Run a single test and account for it in betatest_stats */
+BETATEST_FUNC void betatest_execute_test(const betatest_test *test) {
+    const char *name = test->name;
+    betatest_output_hooks();
+    betatest_reporter_open();
+    betatest_sync_counters();
+    betatest_lock(&betatest_output.lock);
+    betatest_clear_failures();
+    betatest_unlock(&betatest_output.lock);
+    int run = betatest_stats.assertions_run;
+    int passed = betatest_stats.assertions_passed;
+    int failed = betatest_stats.assertions_failed;
+    betatest_stats.current_test_name = name;
+    betatest_stats.tests_run++;
+    betatest_stats.current_test_failed = 0;
+    betatest_last_site = NULL;
+    betatest_crash.signal = 0;
+    int timeout_ms = betatest_timeout_ms(test->timeout_ms);
+    int print_nl = 0;
+    if (BETATEST_DO_PRINT_TEST) {
+        /* Written out right away so a hanging test can be identified */
+        betatest_printf("%s%s[TEST]%s %s%s\n", BETATEST_COLOR_BOLD,
+                        BETATEST_COLOR_CYAN, BETATEST_COLOR_RESET, name,
+                        BETATEST_COLOR_RESET);
+        betatest_flush_output();
+        print_nl = 1;
+    }
+    /* Suite setup is shared by the whole suite, so it is not timed. Its
+     * assertions count against the test that triggered it. */
+    int timed_out = 0;
+    if (test->suite != NULL) {
+        timed_out = betatest_suite_enter(test->suite, timeout_ms);
+    }
+    long long wall_ns = betatest_clock_ns(CLOCK_MONOTONIC);
+    long long cpu_ns = betatest_clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    int perf = betatest_perf_wanted();
+    betatest_perf_mark perf_mark;
+    betatest_alloc_mark alloc_mark = betatest_alloc_begin();
+    if (perf) {
+        betatest_perf_begin(&perf_mark);
+    }
+    if (!timed_out) {
+        timed_out = betatest_call_test(test, timeout_ms);
+    }
+    if (perf) {
+        betatest_perf_end(&perf_mark, &betatest_test_perf);
+    }
+    betatest_test_allocs = betatest_alloc_end(&alloc_mark);
+    wall_ns = betatest_clock_ns(CLOCK_MONOTONIC) - wall_ns;
+    cpu_ns = betatest_clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_ns;
+    betatest_sync_counters();
+    int status = BETATEST_STATUS_PASSED;
+    int printed = 0;
+    if (timed_out) {
+        int sig = betatest_crash.signal;
+        char where[256] = "no assertion reached";
+        const betatest_site *last = betatest_last_site;
+        if (last != NULL) {
+            snprintf(where, sizeof(where), "last assertion at %s:%d",
+                     last->file, last->line);
+        }
+        char message[384];
+        if (sig != 0) {
+            snprintf(message, sizeof(message), "Crashed with %s (%s), %s",
+                     betatest_signal_name(sig), strsignal(sig), where);
+        } else {
+            snprintf(message, sizeof(message), "Timed out after %d ms, %s",
+                     timeout_ms, where);
+        }
+        betatest_lock(&betatest_output.lock);
+        betatest_capture_failure(
+            last ? last->file : "<unknown>", last ? last->line : 0, message);
+        betatest_unlock(&betatest_output.lock);
+        betatest_stats.current_test_failed = 1;
+        if (sig != 0) {
+            /* A crash is an ordinary failure to the reporters */
+            status = BETATEST_STATUS_FAILED;
+            betatest_stats.tests_failed++;
+        } else {
+            status = BETATEST_STATUS_TIMED_OUT;
+            betatest_stats.tests_timed_out++;
+        }
+        if (BETATEST_DO_PRINT_FAIL) {
+            betatest_printf("%s[%s]%s %s ", BETATEST_COLOR_RED,
+                            sig != 0 ? "CRASH" : "TIMEOUT",
+                            BETATEST_COLOR_RESET, name);
+            betatest_print_times(wall_ns, cpu_ns);
+            betatest_printf("\n          %s\n", message);
+            printed = 1;
+        }
+    } else if (betatest_stats.current_test_failed) {
+        status = BETATEST_STATUS_FAILED;
+        betatest_stats.tests_failed++;
+        if (BETATEST_DO_PRINT_FAIL) {
+            BETATEST_PRINT_FAIL();
+            betatest_printf("%s ", name);
+            betatest_print_times(wall_ns, cpu_ns);
+            betatest_printf("\n");
+            printed = 1;
+        }
+    } else {
+        betatest_stats.tests_passed++;
+        if (BETATEST_DO_PRINT_PASS) {
+            BETATEST_PRINT_PASS();
+            betatest_printf("%s ", name);
+            betatest_print_times(wall_ns, cpu_ns);
+            betatest_printf("\n");
+            printed = 1;
+        }
+    }
+    if (printed && perf) {
+        betatest_print_perf(name, &betatest_test_perf, 1.0);
+    }
+    print_nl |= printed;
+    if (betatest_is_slow(wall_ns)) {
+        betatest_printf("%s[SLOW]%s %s took %.3f ms, over the %.3f ms "
+                        "budget\n",
+                        BETATEST_COLOR_YELLOW, BETATEST_COLOR_RESET, name,
+                        (double)wall_ns / 1e6, betatest_slow_threshold_ms());
+        print_nl = 1;
+    }
+    if (!timed_out && (betatest_test_allocs.leaked_blocks > 0 ||
+                       betatest_test_allocs.leaked_bytes > 0)) {
+        betatest_printf("%s[LEAK]%s %s leaked %ld block%s, %ld bytes\n",
+                        BETATEST_COLOR_YELLOW, BETATEST_COLOR_RESET, name,
+                        betatest_test_allocs.leaked_blocks,
+                        betatest_test_allocs.leaked_blocks == 1 ? "" : "s",
+                        betatest_test_allocs.leaked_bytes);
+        print_nl = 1;
+    }
+    if (print_nl) {
+        betatest_printf("\n");
+    }
+    betatest_flush_output();
+    betatest_record_timing(name, betatest_stats.current_test_failed, wall_ns,
+                           cpu_ns);
+
+    betatest_report report;
+    report.name = name;
+    report.status = status;
+    report.wall_ns = wall_ns;
+    report.cpu_ns = cpu_ns;
+    report.assertions_run = betatest_stats.assertions_run - run;
+    report.assertions_passed = betatest_stats.assertions_passed - passed;
+    report.assertions_failed = betatest_stats.assertions_failed - failed;
+    report.allocs = betatest_test_allocs;
+    report.perf = perf ? &betatest_test_perf : NULL;
+    report.failures = betatest_failures.items;
+    report.nfailures = betatest_failures.count;
+    betatest_report_test(&report);
+
+    if (test->suite != NULL && test->suite->pending > 0 &&
+        --test->suite->pending == 0) {
+        betatest_suite_leave(test->suite);
+    }
+}
+
+BETATEST_FUNC int betatest_compare_timing(const void *a, const void *b) {
+    long long wa = (*(const betatest_timing *const *)a)->wall_ns;
+    long long wb = (*(const betatest_timing *const *)b)->wall_ns;
+    return (wa < wb) - (wa > wb);
+}
+
+/* Print the BETATEST_SLOWEST_COUNT slowest tests, slowest first */
+BETATEST_FUNC void betatest_print_slowest(void) {
+    int n = betatest_timings.count;
+    if (BETATEST_SLOWEST_COUNT <= 0 || n == 0) {
+        return;
+    }
+    const betatest_timing **sorted =
+        (const betatest_timing **)malloc((size_t)n * sizeof(*sorted));
+    if (sorted == NULL) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        sorted[i] = &betatest_timings.entries[i];
+    }
+    qsort(sorted, (size_t)n, sizeof(*sorted), betatest_compare_timing);
+    if (n > BETATEST_SLOWEST_COUNT) {
+        n = BETATEST_SLOWEST_COUNT;
+    }
+    betatest_printf("%sSlowest tests:%s\n", BETATEST_COLOR_BOLD,
+                    BETATEST_COLOR_RESET);
+    betatest_printf("  %12s  %12s  %s\n", "wall ms", "cpu ms", "test");
+    for (int i = 0; i < n; i++) {
+        const char *color = betatest_is_slow(sorted[i]->wall_ns)
+                                ? BETATEST_COLOR_YELLOW
+                                : (sorted[i]->failed ? BETATEST_COLOR_RED : "");
+        betatest_printf("  %s%12.3f%s  %12.3f  %s\n", color,
+                        (double)sorted[i]->wall_ns / 1e6,
+                        *color ? BETATEST_COLOR_RESET : "",
+                        (double)sorted[i]->cpu_ns / 1e6, sorted[i]->name);
+    }
+    betatest_printf("\n");
+    free(sorted);
+}
+
+/* Performance baselines
+ *
+ * MEASURE times a block inside a test. With --write-baseline the samples of
+ * every measurement are saved to a file, one "test/measure n s1 ... sn" line
+ * each (nanoseconds). With --baseline the samples are compared against that
+ * file: a bootstrap over both sample sets gives a 95% lower bound on the
+ * slowdown of the median, and a measurement whose bound exceeds
+ * BETATEST_REGRESSION_THRESHOLD_PCT fails the test. */
+typedef struct {
+    char *key;
+    int nsamples;
+    long long *samples_ns;
+    int compared;
+    int regressed;
+} betatest_measurement;
+
+/* Measurements taken in this run */
+BETATEST_DATA struct {
+    betatest_measurement *items;
+    int count;
+    int cap;
+} betatest_measurements BETATEST_INIT({NULL, 0, 0});
+
+BETATEST_DATA struct {
+    const char *path;       /* compare against this file */
+    const char *write_path; /* save this run's measurements here */
+    int loaded;
+    betatest_measurement *items;
+    int count;
+    int cap;
+} betatest_baseline BETATEST_INIT({NULL, NULL, 0, NULL, 0, 0});
+
+/* State of one MEASURE loop */
+typedef struct {
+    const char *name;
+    const char *file;
+    int line;
+    int runs;
+    long long start_ns;
+    long long samples_ns[BETATEST_MEASURE_SAMPLES];
+} betatest_measure;
+
+BETATEST_FUNC betatest_measurement *
+betatest_measurement_add(betatest_measurement **items, int *count, int *cap,
+                         const char *key, const long long *samples_ns,
+                         int nsamples) {
+    if (nsamples <= 0 || betatest_grow(items, cap, *count,
+                                       sizeof(betatest_measurement)) != 0) {
+        return NULL;
+    }
+    betatest_measurement *m = &(*items)[*count];
+    m->key = strdup(key);
+    m->samples_ns = (long long *)malloc((size_t)nsamples * sizeof(long long));
+    if (m->key == NULL || m->samples_ns == NULL) {
+        free(m->key);
+        free(m->samples_ns);
+        return NULL;
+    }
+    memcpy(m->samples_ns, samples_ns, (size_t)nsamples * sizeof(long long));
+    m->nsamples = nsamples;
+    m->compared = 0;
+    m->regressed = 0;
+    (*count)++;
+    return m;
+}
+
+BETATEST_FUNC void betatest_measurements_free(betatest_measurement *items,
+                                              int count) {
+    for (int i = 0; i < count; i++) {
+        free(items[i].key);
+        free(items[i].samples_ns);
+    }
+    free(items);
+}
+
+BETATEST_FUNC betatest_measurement *
+betatest_measurement_find(betatest_measurement *items, int count,
+                          const char *key) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(items[i].key, key) == 0) {
+            return &items[i];
+        }
+    }
+    return NULL;
+}
+
+/* Read a baseline file into *items. Returns -1 if it cannot be opened. */
+BETATEST_FUNC int betatest_baseline_read(const char *path,
+                                         betatest_measurement **items,
+                                         int *count, int *cap) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    char *line = NULL;
+    size_t size = 0;
+    long long *samples = NULL;
+    int samples_cap = 0;
+    while (getline(&line, &size, in) != -1) {
+        char *save = NULL;
+        char *key = strtok_r(line, " \t\n", &save);
+        char *count_str = key ? strtok_r(NULL, " \t\n", &save) : NULL;
+        if (key == NULL || key[0] == '#' || count_str == NULL) {
+            continue;
+        }
+        int n = atoi(count_str);
+        int got = 0;
+        char *tok;
+        while (got < n && (tok = strtok_r(NULL, " \t\n", &save)) != NULL) {
+            if (betatest_grow(&samples, &samples_cap, got,
+                              sizeof(long long)) != 0) {
+                break;
+            }
+            samples[got++] = strtoll(tok, NULL, 10);
+        }
+        if (got == n) {
+            betatest_measurement_add(items, count, cap, key, samples, n);
+        }
+    }
+    free(samples);
+    free(line);
+    fclose(in);
+    return 0;
+}
+
+/* Load the --baseline/BETATEST_BASELINE file, once */
+BETATEST_FUNC void betatest_baseline_load(void) {
+    if (betatest_baseline.loaded) {
+        return;
+    }
+    betatest_baseline.loaded = 1;
+    if (betatest_baseline.path == NULL) {
+        betatest_baseline.path = getenv("BETATEST_BASELINE");
+    }
+    if (betatest_baseline.path == NULL) {
+        return;
+    }
+    if (betatest_baseline_read(betatest_baseline.path,
+                               &betatest_baseline.items,
+                               &betatest_baseline.count,
+                               &betatest_baseline.cap) != 0) {
+        fprintf(stderr, "betatest: cannot read baseline '%s': %s\n",
+                betatest_baseline.path, strerror(errno));
+    }
+}
+
+BETATEST_FUNC double betatest_regression_threshold_pct(void) {
+    static double threshold = -1.0;
+    if (threshold < 0.0) {
+        const char *env = getenv("BETATEST_REGRESSION_THRESHOLD_PCT");
+        threshold = env ? atof(env)
+                        : (double)BETATEST_REGRESSION_THRESHOLD_PCT;
+        if (threshold < 0.0) {
+            threshold = 0.0;
+        }
+    }
+    return threshold;
+}
+
+/* xorshift64* */
+BETATEST_FUNC unsigned long betatest_random(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717UL;
+}
+
+/* Median of a resample (with replacement) of samples, using scratch[n] */
+BETATEST_FUNC double betatest_resample_median(const long long *samples, int n,
+                                              double *scratch,
+                                              unsigned long *state) {
+    for (int i = 0; i < n; i++) {
+        scratch[i] = (double)samples[betatest_random(state) % (unsigned)n];
+    }
+    qsort(scratch, (size_t)n, sizeof(double), betatest_compare_double);
+    return betatest_median(scratch, n);
+}
+
+/* One-sided 95% lower bound, in percent, on how much slower the median of
+ * cur is than the median of base. Seeded from the key so that reruns on the
+ * same data agree. */
+BETATEST_FUNC double
+betatest_bootstrap_slowdown(const char *key, const betatest_measurement *cur,
+                            const betatest_measurement *base) {
+    const int resamples = BETATEST_BOOTSTRAP_RESAMPLES > 0
+                              ? BETATEST_BOOTSTRAP_RESAMPLES
+                              : 1;
+    int n = cur->nsamples > base->nsamples ? cur->nsamples : base->nsamples;
+    double *scratch = (double *)malloc((size_t)n * sizeof(double));
+    double *slowdowns = (double *)malloc((size_t)resamples * sizeof(double));
+    if (scratch == NULL || slowdowns == NULL) {
+        free(scratch);
+        free(slowdowns);
+        return 0.0;
+    }
+    unsigned long state = betatest_hash_str(key, 14695981039346656037UL) | 1;
+    for (int r = 0; r < resamples; r++) {
+        double c = betatest_resample_median(cur->samples_ns, cur->nsamples,
+                                            scratch, &state);
+        double b = betatest_resample_median(base->samples_ns, base->nsamples,
+                                            scratch, &state);
+        slowdowns[r] = b > 0.0 ? (c / b - 1.0) * 100.0 : 0.0;
+    }
+    qsort(slowdowns, (size_t)resamples, sizeof(double),
+          betatest_compare_double);
+    double bound = betatest_quantile(slowdowns, resamples, 0.05);
+    free(scratch);
+    free(slowdowns);
+    return bound;
+}
+
+/* Sorted copy of a measurement's samples; caller frees */
+BETATEST_FUNC double *betatest_sorted_samples(const betatest_measurement *m) {
+    double *sorted = (double *)malloc((size_t)m->nsamples * sizeof(double));
+    if (sorted == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < m->nsamples; i++) {
+        sorted[i] = (double)m->samples_ns[i];
+    }
+    qsort(sorted, (size_t)m->nsamples, sizeof(double),
+          betatest_compare_double);
+    return sorted;
+}
+
+/* Record a finished MEASURE and compare it against the baseline */
+BETATEST_FUNC void betatest_measure_finish(const betatest_measure *state) {
+    char key[256];
+    snprintf(key, sizeof(key), "%s/%s",
+             betatest_stats.current_test_name ? betatest_stats.current_test_name
+                                              : "none",
+             state->name);
+    betatest_measurement *m = betatest_measurement_add(
+        &betatest_measurements.items, &betatest_measurements.count,
+        &betatest_measurements.cap, key, state->samples_ns,
+        BETATEST_MEASURE_SAMPLES);
+    double *sorted = m ? betatest_sorted_samples(m) : NULL;
+    if (sorted == NULL) {
+        return;
+    }
+    double median_us = betatest_median(sorted, m->nsamples) / 1e3;
+    free(sorted);
+
+    betatest_baseline_load();
+    betatest_measurement *base = betatest_measurement_find(
+        betatest_baseline.items, betatest_baseline.count, key);
+    sorted = base ? betatest_sorted_samples(base) : NULL;
+    if (sorted == NULL) {
+        betatest_printf("%s[MEASURE]%s %s: %.3f us median of %d runs\n",
+                        BETATEST_COLOR_YELLOW, BETATEST_COLOR_RESET, key,
+                        median_us, m->nsamples);
+        return;
+    }
+    double base_us = betatest_median(sorted, base->nsamples) / 1e3;
+    free(sorted);
+    double change = base_us > 0.0 ? (median_us / base_us - 1.0) * 100.0 : 0.0;
+    double bound = betatest_bootstrap_slowdown(key, m, base);
+    double threshold = betatest_regression_threshold_pct();
+    m->compared = 1;
+    m->regressed = bound > threshold;
+    betatest_printf("%s[MEASURE]%s %s: %.3f us median of %d runs, baseline "
+                    "%.3f us (%+.1f%%)\n",
+                    BETATEST_COLOR_YELLOW, BETATEST_COLOR_RESET, key,
+                    median_us, m->nsamples, base_us, change);
+    if (m->regressed) {
+        betatest_fail(state->file, state->line,
+                      "Performance regression in %s: median %.3f us vs "
+                      "baseline %.3f us (%+.1f%%, at least %+.1f%% with 95%% "
+                      "confidence; threshold %.1f%%)",
+                      key, median_us, base_us, change, bound, threshold);
+    } else {
+        BETATEST_RECORD_PASS();
+        betatest_note_site(state->file, state->line);
+    }
+}
+
+BETATEST_FUNC betatest_measure betatest_measure_begin(const char *name,
+                                                      const char *file,
+                                                      int line) {
+    betatest_measure state;
+    state.name = name;
+    state.file = file;
+    state.line = line;
+    state.runs = 0;
+    state.start_ns = 0;
+    return state;
+}
+
+/* Loop condition of MEASURE: the first run is a warmup, the next
+ * BETATEST_MEASURE_SAMPLES runs are timed */
+BETATEST_FUNC int betatest_measure_next(betatest_measure *state) {
+    long long now = betatest_clock_ns(CLOCK_MONOTONIC);
+    if (state->runs > 1) {
+        state->samples_ns[state->runs - 2] = now - state->start_ns;
+    }
+    if (state->runs == BETATEST_MEASURE_SAMPLES + 1) {
+        betatest_untracked++;
+        betatest_measure_finish(state);
+        betatest_untracked--;
+        return 0;
+    }
+    state->runs++;
+    state->start_ns = betatest_clock_ns(CLOCK_MONOTONIC);
+    return 1;
+}
+
+/* Time the following block inside a TEST:
+ *
+ *     MEASURE(parse_config) {
+ *         BETATEST_DO_NOT_OPTIMIZE(parse_config(text));
+ *     }
+ *
+ * The block runs BETATEST_MEASURE_SAMPLES + 1 times, so it should not carry
+ * state from one run to the next. Leaving it with break or return discards
+ * the measurement. */
+#define MEASURE(name)                                                          \
+    for (betatest_measure _betatest_measure =                                  \
+             betatest_measure_begin(#name, __FILE__, __LINE__);                \
+         betatest_measure_next(&_betatest_measure);)
+
+/* Save this run's measurements to --write-baseline/BETATEST_WRITE_BASELINE.
+ * Entries of the old file that were not measured this time are kept, so a
+ * filtered run only updates what it measured. */
+BETATEST_FUNC void betatest_baseline_write(void) {
+    const char *path = betatest_baseline.write_path;
+    if (path == NULL) {
+        path = getenv("BETATEST_WRITE_BASELINE");
+    }
+    if (path == NULL) {
+        return;
+    }
+    betatest_measurement *old = NULL;
+    int nold = 0;
+    int old_cap = 0;
+    betatest_baseline_read(path, &old, &nold, &old_cap);
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long)getpid());
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        fprintf(stderr, "betatest: cannot write baseline '%s': %s\n", tmp,
+                strerror(errno));
+        betatest_measurements_free(old, nold);
+        return;
+    }
+    fprintf(out, "# betatest baseline: test/measure samples ns...\n");
+    int written = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        betatest_measurement *items =
+            pass == 0 ? betatest_measurements.items : old;
+        int count = pass == 0 ? betatest_measurements.count : nold;
+        for (int i = 0; i < count; i++) {
+            const betatest_measurement *m = &items[i];
+            if (pass == 1 && betatest_measurement_find(
+                                 betatest_measurements.items,
+                                 betatest_measurements.count, m->key)) {
+                continue;
+            }
+            fprintf(out, "%s %d", m->key, m->nsamples);
+            for (int j = 0; j < m->nsamples; j++) {
+                fprintf(out, " %lld", m->samples_ns[j]);
+            }
+            fprintf(out, "\n");
+            written++;
+        }
+    }
+    betatest_measurements_free(old, nold);
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "betatest: cannot write baseline '%s': %s\n", path,
+                strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    betatest_printf("Baseline:   %d measurements written to %s\n", written,
+                    path);
+}
+
+/* Test registry
+ *
+ * Every TEST registers itself from a constructor before main runs, so
+ * BETATEST_MAIN can run, list and filter tests without a hand-written
+ * RUN_TEST list. */
+BETATEST_DATA struct {
+    betatest_test *tests;
+    int count;
+    int cap;
+} betatest_registry BETATEST_INIT({NULL, 0, 0});
+
+BETATEST_FUNC void betatest_register(const betatest_test *test) {
+    if (betatest_grow(&betatest_registry.tests, &betatest_registry.cap,
+                      betatest_registry.count, sizeof(betatest_test)) != 0) {
+        return;
+    }
+    betatest_registry.tests[betatest_registry.count++] = *test;
+}
+
+/* Command line options, filled in by TEST_PARSE_ARGS or BETATEST_MAIN */
+BETATEST_DATA struct {
+    char **filters;
+    int nfilters;
+    char **excludes;
+    int nexcludes;
+    int list;
+    int jobs;
+    int bench;
+    int fail_fast;     /* stop after this many failed tests (0 = never) */
+    int failed_first;  /* run last run's failures before the other tests */
+    int last_failed;   /* run only last run's failures */
+    int not_run;       /* selected tests skipped by betatest_stop_running */
+    int update_golden; /* rewrite golden files instead of comparing */
+} betatest_options BETATEST_INIT({NULL, 0, NULL, 0, 0, 1, 0, 0, 0, 0, 0, 0});
+
+/* Split a comma separated list of globs and append them to *list */
+BETATEST_FUNC void betatest_add_patterns(char ***list, int *count,
+                                         const char *arg) {
+    while (*arg) {
+        const char *end = strchr(arg, ',');
+        size_t len = end ? (size_t)(end - arg) : strlen(arg);
+        if (len > 0) {
+            char **grown =
+                (char **)realloc(*list, (size_t)(*count + 1) * sizeof(char *));
+            char *pattern = (char *)malloc(len + 1);
+            if (grown == NULL || pattern == NULL) {
+                free(pattern);
+                if (grown != NULL) {
+                    *list = grown;
+                }
+                return;
+            }
+            memcpy(pattern, arg, len);
+            pattern[len] = '\0';
+            *list = grown;
+            (*list)[(*count)++] = pattern;
+        }
+        arg += len;
+        if (*arg == ',') {
+            arg++;
+        }
+    }
+}
+
+BETATEST_FUNC int betatest_glob_any(char **patterns, int count,
+                                    const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (fnmatch(patterns[i], name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Whether the --filter/--exclude options match the named test */
+BETATEST_FUNC int betatest_matches_filters(const char *name) {
+    if (betatest_options.nfilters > 0 &&
+        !betatest_glob_any(betatest_options.filters,
+                           betatest_options.nfilters, name)) {
+        return 0;
+    }
+    return !betatest_glob_any(betatest_options.excludes,
+                              betatest_options.nexcludes, name);
+}
+
+BETATEST_FUNC int betatest_compare_shard_name(const void *a, const void *b) {
+    return strcmp(((const betatest_shard_entry *)a)->name,
+                  ((const betatest_shard_entry *)b)->name);
+}
+
+/* Longest first, then by name so every shard computes the same plan */
+BETATEST_FUNC int betatest_compare_shard_ms(const void *a, const void *b) {
+    const betatest_shard_entry *ea = (const betatest_shard_entry *)a;
+    const betatest_shard_entry *eb = (const betatest_shard_entry *)b;
+    if (ea->ms != eb->ms) {
+        return ea->ms < eb->ms ? 1 : -1;
+    }
+    return strcmp(ea->name, eb->name);
+}
+
+/* Decode the JSON string that starts at *p into a malloc'd string and move
+ * *p past its closing quote. Returns NULL if it is not a valid string. */
+BETATEST_FUNC char *betatest_json_parse_string(const char **p) {
+    const char *s = *p;
+    if (*s++ != '"') {
+        return NULL;
+    }
+    /* Escapes never decode to more bytes than they take up */
+    char *out = (char *)malloc(strlen(s) + 1);
+    char *o = out;
+    while (out != NULL && *s != '"') {
+        char c = *s++;
+        if (c == '\0') {
+            break;
+        }
+        if (c != '\\') {
+            *o++ = c;
+            continue;
+        }
+        c = *s++;
+        if (c == 'u') {
+            char hex[5] = {0};
+            if (strspn(s, "0123456789abcdefABCDEF") < 4) {
+                break;
+            }
+            memcpy(hex, s, 4);
+            unsigned long u = strtoul(hex, NULL, 16);
+            s += 4;
+            if (u < 0x80) {
+                *o++ = (char)u;
+            } else if (u < 0x800) {
+                *o++ = (char)(0xc0 | (u >> 6));
+                *o++ = (char)(0x80 | (u & 0x3f));
+            } else {
+                *o++ = (char)(0xe0 | (u >> 12));
+                *o++ = (char)(0x80 | ((u >> 6) & 0x3f));
+                *o++ = (char)(0x80 | (u & 0x3f));
+            }
+            continue;
+        }
+        const char *from = strchr("\"\\/bfnrt", c);
+        if (c == '\0' || from == NULL) {
+            break;
+        }
+        *o++ = "\"\\/\b\f\n\r\t"[from - "\"\\/bfnrt"];
+    }
+    if (out == NULL || *s != '"') {
+        free(out);
+        return NULL;
+    }
+    *o = '\0';
+    *p = s + 1;
+    return out;
+}
+
+/* Read the "name" and "wall_ms" of every test record in a JSON report.
+ * Returns the number of durations, sorted by name, or -1. */
+BETATEST_FUNC int betatest_read_durations(const char *path,
+                                          betatest_shard_entry **out) {
+    static const char prefix[] = "{\"type\":\"test\",\"name\":";
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    betatest_shard_entry *items = NULL;
+    int count = 0;
+    int cap = 0;
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, in) != -1) {
+        /* Test records are written as {"type":"test","name":...,
+         * "status":"...","wall_ms":...}; the name may hold any escape */
+        if (strncmp(line, prefix, sizeof(prefix) - 1) != 0) {
+            continue;
+        }
+        const char *rest = line + sizeof(prefix) - 1;
+        char *name = betatest_json_parse_string(&rest);
+        const char *ms = name ? strstr(rest, ",\"wall_ms\":") : NULL;
+        if (ms == NULL ||
+            betatest_grow(&items, &cap, count, sizeof(*items)) != 0) {
+            free(name);
+            continue;
+        }
+        items[count].name = name;
+        items[count].ms = strtod(ms + 11, NULL);
+        items[count].shard = 0;
+        count++;
+    }
+    free(line);
+    fclose(in);
+    qsort(items, (size_t)count, sizeof(*items), betatest_compare_shard_name);
+    *out = items;
+    return count;
+}
+
+/* Balance the registered tests over the shards by duration: longest test
+ * first onto the least loaded shard. Tests missing from the report count
+ * as the mean duration of the others. */
+BETATEST_FUNC void betatest_shard_plan(void) {
+    betatest_shard.planned = 1;
+    betatest_shard_entry *durations = NULL;
+    int ndurations =
+        betatest_read_durations(betatest_shard.durations_path, &durations);
+    if (ndurations <= 0) {
+        fprintf(stderr, "betatest: no test durations in '%s', sharding by "
+                        "name\n",
+                betatest_shard.durations_path);
+        free(durations);
+        return;
+    }
+    int n = 0;
+    betatest_shard_entry *plan = (betatest_shard_entry *)malloc(
+        (size_t)(betatest_registry.count + 1) * sizeof(*plan));
+    double *load = (double *)calloc((size_t)betatest_shard.total,
+                                    sizeof(double));
+    if (plan != NULL && load != NULL) {
+        double known_ms = 0.0;
+        int known = 0;
+        for (int i = 0; i < betatest_registry.count; i++) {
+            const char *name = betatest_registry.tests[i].name;
+            if (!betatest_matches_filters(name)) {
+                continue;
+            }
+            betatest_shard_entry key = {name, 0.0, 0};
+            const betatest_shard_entry *found = (const betatest_shard_entry *)
+                bsearch(&key, durations, (size_t)ndurations,
+                        sizeof(*durations), betatest_compare_shard_name);
+            plan[n].name = name;
+            plan[n].ms = found ? found->ms : -1.0;
+            if (found) {
+                known_ms += found->ms;
+                known++;
+            }
+            n++;
+        }
+        for (int i = 0; i < n; i++) {
+            if (plan[i].ms < 0.0) {
+                plan[i].ms = known ? known_ms / known : 0.0;
+            }
+        }
+        qsort(plan, (size_t)n, sizeof(*plan), betatest_compare_shard_ms);
+        for (int i = 0; i < n; i++) {
+            int best = 0;
+            for (int s = 1; s < betatest_shard.total; s++) {
+                if (load[s] < load[best]) {
+                    best = s;
+                }
+            }
+            plan[i].shard = best;
+            load[best] += plan[i].ms;
+        }
+        qsort(plan, (size_t)n, sizeof(*plan), betatest_compare_shard_name);
+        betatest_shard.plan = plan;
+        betatest_shard.plan_count = n;
+        betatest_shard.planned_ms = load[betatest_shard.index];
+    } else {
+        free(plan);
+    }
+    free(load);
+    for (int i = 0; i < ndurations; i++) {
+        free((void *)durations[i].name);
+    }
+    free(durations);
+}
+
+/* Whether the named test or benchmark belongs to this process's shard */
+BETATEST_FUNC int betatest_in_shard(const char *name) {
+    betatest_shard_configure();
+    if (betatest_shard.total <= 1) {
+        return 1;
+    }
+    if (!betatest_shard.planned && betatest_shard.durations_path != NULL) {
+        betatest_shard_plan();
+    }
+    betatest_shard_entry key = {name, 0.0, 0};
+    const betatest_shard_entry *entry =
+        betatest_shard.plan == NULL
+            ? NULL
+            : (const betatest_shard_entry *)bsearch(
+                  &key, betatest_shard.plan, (size_t)betatest_shard.plan_count,
+                  sizeof(key), betatest_compare_shard_name);
+    if (entry != NULL) {
+        return entry->shard == betatest_shard.index;
+    }
+    /* FNV-1a spreads short similar names poorly over the low bits, so mix
+     * the hash before taking the remainder */
+    unsigned long hash = betatest_hash_str(name, 14695981039346656037UL);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    return (int)(hash % (unsigned long)betatest_shard.total) ==
+           betatest_shard.index;
+}
+
+/* Last-run state
+ *
+ * TEST_SUMMARY saves the status and wall time of every test that ran to a
+ * state file, keeping the old records of tests this run did not reach.
+ * --failed-first and --last-failed read it back to rerun the previous
+ * failures before, or instead of, the other tests. The file is only written
+ * when --state-file or BETATEST_STATE_FILE names it, or when --failed-first,
+ * --last-failed or --fail-fast is given, which default it to the test
+ * binary's path plus ".betatest-state". */
+typedef struct {
+    char *name;
+    double ms;
+    int failed;
+} betatest_state_entry;
+
+BETATEST_DATA struct {
+    const char *path;
+    char *default_path;
+    betatest_state_entry *entries; /* sorted by name */
+    int count;
+    int nfailed;
+} betatest_state BETATEST_INIT({NULL, NULL, NULL, 0, 0});
+
+BETATEST_FUNC int betatest_compare_state(const void *a, const void *b) {
+    return strcmp(((const betatest_state_entry *)a)->name,
+                  ((const betatest_state_entry *)b)->name);
+}
+
+BETATEST_FUNC void betatest_state_free(betatest_state_entry *entries,
+                                       int count) {
+    for (int i = 0; i < count; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+/* Read "passed|failed wall_ms name" lines into entries sorted by name.
+ * Returns the number of entries, or -1 if the file cannot be opened. */
+BETATEST_FUNC int betatest_state_read(const char *path,
+                                      betatest_state_entry **out) {
+    *out = NULL;
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    betatest_state_entry *items = NULL;
+    int count = 0;
+    int cap = 0;
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, in) != -1) {
+        char status[16];
+        double ms;
+        int name_at = 0;
+        if (line[0] == '#' ||
+            sscanf(line, "%15s %lf %n", status, &ms, &name_at) != 2 ||
+            name_at == 0) {
+            continue;
+        }
+        char *name = line + name_at;
+        name[strcspn(name, "\r\n")] = '\0';
+        if (*name == '\0' ||
+            betatest_grow(&items, &cap, count, sizeof(*items)) != 0) {
+            continue;
+        }
+        items[count].name = strdup(name);
+        items[count].ms = ms;
+        items[count].failed = strcmp(status, "failed") == 0;
+        if (items[count].name != NULL) {
+            count++;
+        }
+    }
+    free(line);
+    fclose(in);
+    qsort(items, (size_t)count, sizeof(*items), betatest_compare_state);
+    *out = items;
+    return count;
+}
+
+BETATEST_FUNC const char *betatest_state_path(void) {
+    return betatest_state.path ? betatest_state.path
+                               : getenv("BETATEST_STATE_FILE");
+}
+
+/* Load the previous run for --failed-first/--last-failed */
+BETATEST_FUNC void betatest_state_load(void) {
+    const char *path = betatest_state_path();
+    int count = path == NULL || *path == '\0'
+                    ? -1
+                    : betatest_state_read(path, &betatest_state.entries);
+    betatest_state.count = count > 0 ? count : 0;
+    for (int i = 0; i < betatest_state.count; i++) {
+        betatest_state.nfailed += betatest_state.entries[i].failed;
+    }
+}
+
+BETATEST_FUNC const betatest_state_entry *
+betatest_state_find(const char *name) {
+    betatest_state_entry key = {(char *)name, 0.0, 0};
+    return betatest_state.entries == NULL
+               ? NULL
+               : (const betatest_state_entry *)bsearch(
+                     &key, betatest_state.entries,
+                     (size_t)betatest_state.count, sizeof(key),
+                     betatest_compare_state);
+}
+
+/* Whether a test failed last run. For a TEST_P that includes any of its
+ * cases ("name/N"); *ms is then the quickest failed case. */
+BETATEST_FUNC int betatest_state_failed(const betatest_test *test,
+                                        double *ms) {
+    const betatest_state_entry *e = betatest_state_find(test->name);
+    int failed = e != NULL && e->failed;
+    *ms = e ? e->ms : 0.0;
+    if (test->params == NULL) {
+        return failed;
+    }
+    /* Cases sort right after the first name not below "name/" */
+    size_t len = strlen(test->name);
+    int lo = 0;
+    int hi = betatest_state.count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const char *n = betatest_state.entries[mid].name;
+        int c = strncmp(n, test->name, len);
+        if (c < 0 || (c == 0 && n[len] < '/')) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (int i = lo; i < betatest_state.count &&
+                    strncmp(betatest_state.entries[i].name, test->name,
+                            len) == 0 &&
+                    betatest_state.entries[i].name[len] == '/';
+         i++) {
+        const betatest_state_entry *e = &betatest_state.entries[i];
+        if (e->failed && (!failed || e->ms < *ms)) {
+            *ms = e->ms;
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+/* Save this run's test results, merged with the older records */
+BETATEST_FUNC void betatest_state_write(void) {
+    const char *path = betatest_state_path();
+    if (path == NULL || *path == '\0' || betatest_timings.count == 0) {
+        return;
+    }
+    int n = betatest_timings.count;
+    betatest_state_entry *ran =
+        (betatest_state_entry *)malloc((size_t)n * sizeof(*ran));
+    if (ran == NULL) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        const betatest_timing *t = &betatest_timings.entries[i];
+        ran[i].name = (char *)t->name;
+        ran[i].ms = (double)t->wall_ns / 1e6;
+        ran[i].failed = t->failed;
+    }
+    qsort(ran, (size_t)n, sizeof(*ran), betatest_compare_state);
+    betatest_state_entry *old = NULL;
+    int nold = betatest_state_read(path, &old);
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long)getpid());
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        fprintf(stderr, "betatest: cannot write state '%s': %s\n", tmp,
+                strerror(errno));
+        betatest_state_free(old, nold);
+        free(ran);
+        return;
+    }
+    fprintf(out, "# betatest state: passed|failed wall_ms name\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "%s %.3f %s\n", ran[i].failed ? "failed" : "passed",
+                ran[i].ms, ran[i].name);
+    }
+    for (int i = 0; i < nold; i++) {
+        if (!bsearch(&old[i], ran, (size_t)n, sizeof(*ran),
+                     betatest_compare_state)) {
+            fprintf(out, "%s %.3f %s\n", old[i].failed ? "failed" : "passed",
+                    old[i].ms, old[i].name);
+        }
+    }
+    betatest_state_free(old, nold);
+    free(ran);
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "betatest: cannot write state '%s': %s\n", path,
+                strerror(errno));
+        unlink(tmp);
+    }
+}
+
+typedef struct {
+    int index;
+    double ms;
+} betatest_order_entry;
+
+/* Quickest first, then in definition order */
+BETATEST_FUNC int betatest_compare_order(const void *a, const void *b) {
+    const betatest_order_entry *ea = (const betatest_order_entry *)a;
+    const betatest_order_entry *eb = (const betatest_order_entry *)b;
+    if (ea->ms != eb->ms) {
+        return ea->ms < eb->ms ? -1 : 1;
+    }
+    return ea->index - eb->index;
+}
+
+/* Registry indexes in run order: definition order, except that with
+ * --failed-first the tests that failed last run go first, quickest first.
+ * Returns a malloc'd array, or NULL for plain definition order. */
+BETATEST_FUNC int *betatest_run_order(void) {
+    int n = betatest_registry.count;
+    if (!betatest_options.failed_first || betatest_state.nfailed == 0 ||
+        n == 0) {
+        return NULL;
+    }
+    betatest_order_entry *failed =
+        (betatest_order_entry *)malloc((size_t)n * sizeof(*failed));
+    int *order = (int *)malloc((size_t)n * sizeof(int));
+    if (failed == NULL || order == NULL) {
+        free(failed);
+        free(order);
+        return NULL;
+    }
+    int nfailed = 0;
+    int rest = n;
+    for (int i = n - 1; i >= 0; i--) {
+        double ms = 0.0;
+        if (betatest_state_failed(&betatest_registry.tests[i], &ms)) {
+            failed[nfailed].index = i;
+            failed[nfailed++].ms = ms;
+        } else {
+            order[--rest] = i;
+        }
+    }
+    qsort(failed, (size_t)nfailed, sizeof(*failed), betatest_compare_order);
+    for (int i = 0; i < nfailed; i++) {
+        order[i] = failed[i].index;
+    }
+    free(failed);
+    return order;
+}
+
+/* Whether to run no more tests: --fail-fast has seen enough failed tests,
+ * or a test was interrupted and may have left this process broken */
+BETATEST_FUNC int betatest_stop_running(void) {
+    return betatest_interrupted ||
+           (betatest_options.fail_fast > 0 &&
+            betatest_stats.tests_failed + betatest_stats.tests_timed_out >=
+                betatest_options.fail_fast);
+}
+
+/* Whether the command line selects the named test: it matches the
+ * --filter/--exclude options, belongs to this shard and, with
+ * --last-failed, failed last run */
+BETATEST_FUNC int betatest_selected(const char *name) {
+    if (betatest_options.last_failed) {
+        const betatest_state_entry *e = betatest_state_find(name);
+        if (e == NULL || !e->failed) {
+            return 0;
+        }
+    }
+    return betatest_matches_filters(name) && betatest_in_shard(name);
+}
+
+/* TEST_P case indexes selected by --case-range or BETATEST_CASE_RANGE */
+BETATEST_DATA struct {
+    int configured;
+    size_t begin;
+    size_t end; /* exclusive */
+} betatest_case_range BETATEST_INIT({0, 0, (size_t)-1});
+
+/* Parse "BEGIN:END" (END exclusive, either may be left out) or "INDEX" */
+BETATEST_FUNC int betatest_set_case_range(const char *arg) {
+    size_t begin = 0;
+    size_t end = (size_t)-1;
+    char *stop;
+    if (*arg != ':') {
+        begin = (size_t)strtoull(arg, &stop, 10);
+        if (stop == arg) {
+            return -1;
+        }
+        arg = stop;
+        if (*arg == '\0') {
+            end = begin + 1;
+        }
+    }
+    if (*arg == ':' && arg[1] != '\0') {
+        end = (size_t)strtoull(arg + 1, &stop, 10);
+        if (stop == arg + 1 || *stop != '\0') {
+            return -1;
+        }
+    } else if (*arg != '\0' && strcmp(arg, ":") != 0) {
+        return -1;
+    }
+    if (end < begin) {
+        return -1;
+    }
+    betatest_case_range.configured = 1;
+    betatest_case_range.begin = begin;
+    betatest_case_range.end = end;
+    return 0;
+}
+
+/* Apply BETATEST_CASE_RANGE unless --case-range was given */
+BETATEST_FUNC void betatest_case_range_configure(void) {
+    if (betatest_case_range.configured) {
+        return;
+    }
+    const char *env = getenv("BETATEST_CASE_RANGE");
+    if (env != NULL && betatest_set_case_range(env) != 0) {
+        fprintf(stderr, "betatest: bad BETATEST_CASE_RANGE '%s'\n", env);
+    }
+    betatest_case_range.configured = 1;
+}
+
+/* Whether case `index` of TEST_P `test` is selected. A filter may name
+ * either the whole test or single cases ("codec/12*"). */
+BETATEST_FUNC int betatest_case_selected(const char *test, const char *name,
+                                         size_t index) {
+    if (index < betatest_case_range.begin || index >= betatest_case_range.end) {
+        return 0;
+    }
+    if (betatest_options.nfilters > 0 &&
+        !betatest_glob_any(betatest_options.filters,
+                           betatest_options.nfilters, test) &&
+        !betatest_glob_any(betatest_options.filters,
+                           betatest_options.nfilters, name)) {
+        return 0;
+    }
+    if (betatest_glob_any(betatest_options.excludes,
+                          betatest_options.nexcludes, test) ||
+        betatest_glob_any(betatest_options.excludes,
+                          betatest_options.nexcludes, name)) {
+        return 0;
+    }
+    if (betatest_options.last_failed) {
+        const betatest_state_entry *e = betatest_state_find(name);
+        if (e == NULL || !e->failed) {
+            return 0;
+        }
+    }
+    return betatest_in_shard(name);
+}
+
+/* Expand a TEST_P into one test per selected case, named "test/index".
+ * A TEST_P whose cases cannot be loaded becomes a single failing test. */
+BETATEST_FUNC void betatest_build_cases(const betatest_test *test) {
+    betatest_params *params = test->params;
+    if (params->cases != NULL) {
+        return;
+    }
+    betatest_case_range_configure();
+    size_t count = 0;
+    if (betatest_params_load(params) > 0) {
+        count = params->count;
+        if (betatest_case_range.end < count) {
+            count = betatest_case_range.end;
+        }
+    }
+    params->cases = (betatest_test *)malloc((count ? count : 1) *
+                                            sizeof(betatest_test));
+    if (params->cases == NULL) {
+        return;
+    }
+    if (params->loaded < 0) {
+        params->cases[0] = *test;
+        params->cases[0].fn = betatest_case_main;
+        params->ncases = betatest_selected(test->name) ? 1 : 0;
+        return;
+    }
+    char name[512];
+    for (size_t i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "%s/%zu", test->name, i);
+        if (!betatest_case_selected(test->name, name, i)) {
+            continue;
+        }
+        betatest_test *c = &params->cases[params->ncases];
+        *c = *test;
+        c->name = strdup(name);
+        c->fn = betatest_case_main;
+        c->case_index = i;
+        if (c->name != NULL) {
+            params->ncases++;
+        }
+    }
+}
+
+BETATEST_FUNC void betatest_usage(const char *prog) {
+    printf("Usage: %s [options]\n"
+           "  --list                   List the registered tests and exit\n"
+           "  --filter=GLOB[,...]      Only run tests matching a glob\n"
+           "  --exclude=GLOB[,...]     Skip tests matching a glob\n"
+           "  --jobs=N                 Run tests on N processes (0 = CPUs)\n"
+           "  --bench                  Also run the registered benchmarks\n"
+           "  --reporter=NAME          Also report as json or junit\n"
+           "  --report-file=PATH       Write it to PATH (default stdout)\n"
+           "  --baseline=PATH          Fail MEASUREs slower than in PATH\n"
+           "  --write-baseline=PATH    Save MEASURE samples to PATH\n"
+           "  --total-shards=N         Split the tests into N shards\n"
+           "  --shard-index=I          Run shard I (0 to N-1) of them\n"
+           "  --shard-durations=PATH   Balance shards using a json report\n"
+           "  --perf                   Read hardware performance counters\n"
+           "  --timeout=MS             Default per-test timeout (0 = none)\n"
+           "  --catch-crashes          Report crashing tests as failures\n"
+           "  --case-range=BEGIN:END   Only run these TEST_P case indexes\n"
+           "  --fail-fast[=N]          Stop after the first (or N) failed "
+           "tests\n"
+           "  --failed-first           Run last run's failures first\n"
+           "  --last-failed            Only run last run's failures\n"
+           "  --state-file=PATH        Where the last run is saved\n"
+           "  --update-golden          Rewrite golden files from the output\n"
+           "  --help                   Show this message\n",
+           prog);
+}
+
+/* Parse the options above. Returns -1 to continue, or an exit code. */
+BETATEST_FUNC int betatest_parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--filter=", 9) == 0) {
+            betatest_add_patterns(&betatest_options.filters,
+                                  &betatest_options.nfilters, arg + 9);
+        } else if (strncmp(arg, "--exclude=", 10) == 0) {
+            betatest_add_patterns(&betatest_options.excludes,
+                                  &betatest_options.nexcludes, arg + 10);
+        } else if (strcmp(arg, "--list") == 0) {
+            betatest_options.list = 1;
+        } else if (strncmp(arg, "--jobs=", 7) == 0) {
+            betatest_options.jobs = atoi(arg + 7);
+        } else if (strcmp(arg, "--bench") == 0) {
+            betatest_options.bench = 1;
+        } else if (strncmp(arg, "--reporter=", 11) == 0) {
+            betatest_reporting.name = arg + 11;
+        } else if (strncmp(arg, "--report-file=", 14) == 0) {
+            betatest_reporting.path = arg + 14;
+        } else if (strncmp(arg, "--baseline=", 11) == 0) {
+            betatest_baseline.path = arg + 11;
+        } else if (strncmp(arg, "--write-baseline=", 17) == 0) {
+            betatest_baseline.write_path = arg + 17;
+        } else if (strncmp(arg, "--total-shards=", 15) == 0) {
+            betatest_shard.total = atoi(arg + 15);
+        } else if (strncmp(arg, "--shard-index=", 14) == 0) {
+            betatest_shard.index = atoi(arg + 14);
+        } else if (strncmp(arg, "--shard-durations=", 18) == 0) {
+            betatest_shard.durations_path = arg + 18;
+        } else if (strcmp(arg, "--perf") == 0) {
+            betatest_perf.enabled = 1;
+        } else if (strncmp(arg, "--timeout=", 10) == 0) {
+            betatest_watchdog.default_ms = atoi(arg + 10);
+        } else if (strcmp(arg, "--catch-crashes") == 0) {
+            betatest_crash.enabled = 1;
+        } else if (strncmp(arg, "--case-range=", 13) == 0) {
+            if (betatest_set_case_range(arg + 13) != 0) {
+                fprintf(stderr, "%s: bad case range '%s'\n", argv[0],
+                        arg + 13);
+                return 2;
+            }
+        } else if (strcmp(arg, "--fail-fast") == 0) {
+            betatest_options.fail_fast = 1;
+        } else if (strncmp(arg, "--fail-fast=", 12) == 0) {
+            betatest_options.fail_fast = atoi(arg + 12);
+        } else if (strcmp(arg, "--failed-first") == 0) {
+            betatest_options.failed_first = 1;
+        } else if (strcmp(arg, "--last-failed") == 0) {
+            betatest_options.last_failed = 1;
+        } else if (strncmp(arg, "--state-file=", 13) == 0) {
+            betatest_state.path = arg + 13;
+        } else if (strcmp(arg, "--update-golden") == 0) {
+            betatest_options.update_golden = 1;
+        } else if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            betatest_usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "%s: unknown option '%s'\n", argv[0], arg);
+            betatest_usage(argv[0]);
+            return 2;
+        }
+    }
+    if ((betatest_options.failed_first || betatest_options.last_failed ||
+         betatest_options.fail_fast) &&
+        betatest_state_path() == NULL && argc > 0 &&
+        betatest_state.default_path == NULL) {
+        size_t len = strlen(argv[0]);
+        betatest_state.default_path = (char *)malloc(len + 16);
+        if (betatest_state.default_path != NULL) {
+            memcpy(betatest_state.default_path, argv[0], len);
+            memcpy(betatest_state.default_path + len, ".betatest-state", 16);
+            betatest_state.path = betatest_state.default_path;
+        }
+    }
+    if (betatest_options.failed_first || betatest_options.last_failed) {
+        betatest_state_load();
+        if (betatest_options.last_failed && betatest_state.nfailed == 0) {
+            fprintf(stderr, "betatest: no failed tests in '%s', running all\n",
+                    betatest_state_path() ? betatest_state_path() : "");
+            betatest_options.last_failed = 0;
+        }
+    }
+    return betatest_shard_configure() == 0 ? -1 : 2;
+}
+
+/* Parallel runner
+ *
+ * Inside a RUN_ALL_TESTS_PARALLEL block RUN_TEST only queues the test. When
+ * the block ends the queue is handed to a pool of forked workers which claim
+ * tests one at a time from a counter in shared memory and send one result
+ * record per test back to the parent over a pipe. The parent merges the
+ * records into betatest_stats, so TEST_SUMMARY and TEST_RETURN_CODE behave
+ * exactly as for a serial run. A worker that dies mid-test has that test
+ * marked as failed and is replaced while queued tests remain. */
+typedef struct {
+    const betatest_test *test;
+} betatest_job;
+
+typedef struct {
+    int job;
+    int failed;
+    int timed_out;
+    int assertions_run;
+    int assertions_passed;
+    int assertions_failed;
+    long long wall_ns;
+    long long cpu_ns;
+    betatest_alloc_stats allocs;
+    int has_perf;
+    betatest_perf_values perf;
+    int nfailures; /* followed by this many betatest_wire_failure records */
+    int nmeasurements; /* and then this many betatest_wire_measurement */
+} betatest_job_result;
+
+typedef struct {
+    int line;
+    int file_len;
+    int message_len;
+} betatest_wire_failure;
+
+typedef struct {
+    int key_len;
+    int nsamples;
+    int compared;
+    int regressed;
+} betatest_wire_measurement;
+
+BETATEST_DATA struct {
+    int collecting;
+    int jobs;
+    int requested;
+    betatest_job *queue;
+    int queue_len;
+    int queue_cap;
+} betatest_parallel BETATEST_INIT({0, 0, 0, NULL, 0, 0});
+
+BETATEST_FUNC void betatest_parallel_begin(int jobs) {
+    betatest_reporter_open();
+    betatest_baseline_load();
+    if (jobs <= 0) {
+        const char *env = getenv("BETATEST_JOBS");
+        jobs = env ? atoi(env) : 0;
+    }
+    if (jobs <= 0) {
+        jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    betatest_parallel.jobs = jobs > 0 ? jobs : 1;
+    betatest_parallel.requested = 0;
+    betatest_parallel.queue_len = 0;
+    betatest_parallel.collecting = 1;
+}
+
+BETATEST_FUNC void betatest_parallel_enqueue(const betatest_test *test) {
+    if (betatest_grow(&betatest_parallel.queue, &betatest_parallel.queue_cap,
+                      betatest_parallel.queue_len, sizeof(betatest_job)) != 0) {
+        /* Out of memory: fall back to running the test right away */
+        betatest_execute_test(test);
+        return;
+    }
+    betatest_job *job = &betatest_parallel.queue[betatest_parallel.queue_len++];
+    job->test = test;
+}
+
+BETATEST_FUNC int betatest_send_failures(int fd) {
+    for (int i = 0; i < betatest_failures.count; i++) {
+        const betatest_failure *f = &betatest_failures.items[i];
+        betatest_wire_failure wire;
+        wire.line = f->line;
+        wire.file_len = (int)strlen(f->file);
+        wire.message_len = (int)strlen(f->message);
+        if (betatest_write_full(fd, &wire, sizeof(wire)) != 0 ||
+            betatest_write_full(fd, f->file, (size_t)wire.file_len) != 0 ||
+            betatest_write_full(fd, f->message, (size_t)wire.message_len) !=
+                0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Read a worker's failure records into betatest_failures */
+BETATEST_FUNC int betatest_recv_failures(int fd, int count) {
+    betatest_clear_failures();
+    for (int i = 0; i < count; i++) {
+        betatest_wire_failure wire;
+        if (betatest_read_full(fd, &wire, sizeof(wire)) != 1 ||
+            wire.file_len < 0 || wire.message_len < 0) {
+            return -1;
+        }
+        char *file = (char *)malloc((size_t)wire.file_len + 1);
+        char *message = (char *)malloc((size_t)wire.message_len + 1);
+        int ok = file != NULL && message != NULL &&
+                 betatest_read_full(fd, file, (size_t)wire.file_len) == 1 &&
+                 betatest_read_full(fd, message, (size_t)wire.message_len) ==
+                     1;
+        if (ok) {
+            file[wire.file_len] = '\0';
+            message[wire.message_len] = '\0';
+            betatest_capture_failure(file, wire.line, message);
+        }
+        free(file);
+        free(message);
+        if (!ok) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Send the measurements from index `first` on */
+BETATEST_FUNC int betatest_send_measurements(int fd, int first) {
+    for (int i = first; i < betatest_measurements.count; i++) {
+        const betatest_measurement *m = &betatest_measurements.items[i];
+        betatest_wire_measurement wire;
+        wire.key_len = (int)strlen(m->key);
+        wire.nsamples = m->nsamples;
+        wire.compared = m->compared;
+        wire.regressed = m->regressed;
+        if (betatest_write_full(fd, &wire, sizeof(wire)) != 0 ||
+            betatest_write_full(fd, m->key, (size_t)wire.key_len) != 0 ||
+            betatest_write_full(fd, m->samples_ns,
+                                (size_t)m->nsamples * sizeof(long long)) !=
+                0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Read a worker's measurement records into betatest_measurements */
+BETATEST_FUNC int betatest_recv_measurements(int fd, int count) {
+    for (int i = 0; i < count; i++) {
+        betatest_wire_measurement wire;
+        if (betatest_read_full(fd, &wire, sizeof(wire)) != 1 ||
+            wire.key_len < 0 || wire.nsamples <= 0) {
+            return -1;
+        }
+        char *key = (char *)malloc((size_t)wire.key_len + 1);
+        long long *samples =
+            (long long *)malloc((size_t)wire.nsamples * sizeof(long long));
+        int ok = key != NULL && samples != NULL &&
+                 betatest_read_full(fd, key, (size_t)wire.key_len) == 1 &&
+                 betatest_read_full(fd, samples,
+                                    (size_t)wire.nsamples *
+                                        sizeof(long long)) == 1;
+        if (ok) {
+            key[wire.key_len] = '\0';
+            betatest_measurement *m = betatest_measurement_add(
+                &betatest_measurements.items, &betatest_measurements.count,
+                &betatest_measurements.cap, key, samples, wire.nsamples);
+            if (m != NULL) {
+                m->compared = wire.compared;
+                m->regressed = wire.regressed;
+            }
+        }
+        free(key);
+        free(samples);
+        if (!ok) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Worker loop: claim tests until the shared counter runs past the queue */
+BETATEST_FUNC void betatest_worker_main(int fd, int *next, int *current) {
+    for (;;) {
+        int job = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+        if (job >= betatest_parallel.queue_len) {
+            break;
+        }
+        __atomic_store_n(current, job, __ATOMIC_RELAXED);
+        int run = betatest_stats.assertions_run;
+        int passed = betatest_stats.assertions_passed;
+        int failed = betatest_stats.assertions_failed;
+        int measured = betatest_measurements.count;
+        int timed_out = betatest_stats.tests_timed_out;
+        betatest_execute_test(betatest_parallel.queue[job].test);
+        betatest_job_result result;
+        result.job = job;
+        result.failed = betatest_stats.current_test_failed;
+        result.timed_out = betatest_stats.tests_timed_out != timed_out;
+        result.assertions_run = betatest_stats.assertions_run - run;
+        result.assertions_passed = betatest_stats.assertions_passed - passed;
+        result.assertions_failed = betatest_stats.assertions_failed - failed;
+        result.wall_ns = 0;
+        result.cpu_ns = 0;
+        if (betatest_timings.count > 0) {
+            const betatest_timing *t =
+                &betatest_timings.entries[betatest_timings.count - 1];
+            result.wall_ns = t->wall_ns;
+            result.cpu_ns = t->cpu_ns;
+        }
+        result.allocs = betatest_test_allocs;
+        result.has_perf = betatest_perf.enabled == 1;
+        result.perf = betatest_test_perf;
+        result.nfailures = betatest_failures.count;
+        result.nmeasurements = betatest_measurements.count - measured;
+        if (betatest_write_full(fd, &result, sizeof(result)) != 0 ||
+            betatest_send_failures(fd) != 0 ||
+            betatest_send_measurements(fd, measured) != 0) {
+            break;
+        }
+        __atomic_store_n(current, -1, __ATOMIC_RELAXED);
+        if (betatest_interrupted) {
+            /* The interrupted test may have left locks or memory behind;
+             * let the parent start a fresh worker */
+            break;
+        }
+    }
+}
+
+BETATEST_FUNC void betatest_merge_result(const betatest_job_result *result) {
+    betatest_report report;
+    report.name = betatest_parallel.queue[result->job].test->name;
+    report.status = result->timed_out ? BETATEST_STATUS_TIMED_OUT
+                    : result->failed  ? BETATEST_STATUS_FAILED
+                                      : BETATEST_STATUS_PASSED;
+    report.wall_ns = result->wall_ns;
+    report.cpu_ns = result->cpu_ns;
+    report.assertions_run = result->assertions_run;
+    report.assertions_passed = result->assertions_passed;
+    report.assertions_failed = result->assertions_failed;
+    report.allocs = result->allocs;
+    report.perf = result->has_perf ? &result->perf : NULL;
+    report.failures = betatest_failures.items;
+    report.nfailures = betatest_failures.count;
+    betatest_report_test(&report);
+    betatest_record_timing(report.name, result->failed, result->wall_ns,
+                           result->cpu_ns);
+    betatest_stats.tests_run++;
+    if (result->timed_out) {
+        betatest_stats.tests_timed_out++;
+    } else if (result->failed) {
+        betatest_stats.tests_failed++;
+    } else {
+        betatest_stats.tests_passed++;
+    }
+    betatest_stats.assertions_run += result->assertions_run;
+    betatest_stats.assertions_passed += result->assertions_passed;
+    betatest_stats.assertions_failed += result->assertions_failed;
+}
+
+/* Account for a test whose worker exited before reporting it */
+BETATEST_FUNC void betatest_worker_died(const char *name, int status) {
+    char message[64] = "Worker died while running test";
+    if (WIFSIGNALED(status)) {
+        snprintf(message, sizeof(message),
+                 "Worker died while running test (signal %d)",
+                 WTERMSIG(status));
+    }
+    betatest_stats.tests_run++;
+    betatest_stats.tests_failed++;
+    betatest_record_timing(name, 1, 0, 0);
+    if (BETATEST_DO_PRINT_FAIL) {
+        BETATEST_PRINT_FAIL();
+        betatest_printf("%s\n       %s\n\n", name, message);
+    }
+    betatest_flush_output();
+
+    betatest_clear_failures();
+    betatest_capture_failure("<worker>", 0, message);
+    betatest_report report;
+    memset(&report, 0, sizeof(report));
+    report.name = name;
+    report.status = BETATEST_STATUS_FAILED;
+    report.failures = betatest_failures.items;
+    report.nfailures = betatest_failures.count;
+    betatest_report_test(&report);
+}
+
+/* Fork a worker for slot w; returns the read end of its pipe or -1 */
+BETATEST_FUNC int betatest_spawn_worker(int w, int *next, int *current,
+                                        pid_t *pid) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    betatest_flush_output();
+    fflush(stderr);
+    *pid = fork();
+    if (*pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (*pid == 0) {
+        close(fds[0]);
+        betatest_reporting.in_worker = 1;
+        betatest_worker_main(fds[1], next, current + w);
+        betatest_suites_leave_all();
+        betatest_flush_output();
+        _exit(0);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+BETATEST_FUNC void betatest_parallel_end(void) {
+    /* An empty block means "every registered test" */
+    if (betatest_parallel.requested == 0) {
+        int *order = betatest_run_order();
+        for (int i = 0; i < betatest_registry.count; i++) {
+            const betatest_test *t =
+                &betatest_registry.tests[order ? order[i] : i];
+            if (t->params != NULL) {
+                betatest_build_cases(t);
+                for (size_t j = 0; j < t->params->ncases; j++) {
+                    betatest_parallel_enqueue(&t->params->cases[j]);
+                }
+            } else if (betatest_selected(t->name)) {
+                betatest_parallel_enqueue(t);
+            }
+        }
+        free(order);
+    }
+
+    int njobs = betatest_parallel.queue_len;
+    int workers = betatest_parallel.jobs < njobs ? betatest_parallel.jobs
+                                                 : njobs;
+    betatest_parallel.collecting = 0;
+    if (njobs == 0) {
+        return;
+    }
+
+    /* Shared state: [0] is the next job to claim, [1 + w] the job that
+     * worker w is currently running (-1 when idle) */
+    int *shared = NULL;
+    if (workers > 1) {
+        void *map = mmap(NULL, (size_t)(workers + 1) * sizeof(int),
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                         -1, 0);
+        shared = map == MAP_FAILED ? NULL : (int *)map;
+    }
+    if (shared == NULL) {
+        for (int i = 0; i < njobs; i++) {
+            if (betatest_stop_running()) {
+                betatest_options.not_run++;
+            } else {
+                betatest_execute_test(betatest_parallel.queue[i].test);
+            }
+        }
+        betatest_parallel.queue_len = 0;
+        return;
+    }
+    shared[0] = 0;
+
+    struct pollfd *fds = (struct pollfd *)calloc((size_t)workers,
+                                                 sizeof(*fds));
+    pid_t *pids = (pid_t *)calloc((size_t)workers, sizeof(*pids));
+    char *reported = (char *)calloc((size_t)njobs, 1);
+    int live = 0;
+    for (int w = 0; w < workers; w++) {
+        shared[1 + w] = -1;
+        fds[w].fd = betatest_spawn_worker(w, shared, shared + 1, &pids[w]);
+        fds[w].events = POLLIN;
+        if (fds[w].fd >= 0) {
+            live++;
+        }
+    }
+
+    while (live > 0) {
+        if (poll(fds, (nfds_t)workers, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int w = 0; w < workers; w++) {
+            if (fds[w].fd < 0 || fds[w].revents == 0) {
+                continue;
+            }
+            betatest_job_result result;
+            if (betatest_read_full(fds[w].fd, &result, sizeof(result)) == 1 &&
+                betatest_recv_failures(fds[w].fd, result.nfailures) == 0 &&
+                betatest_recv_measurements(fds[w].fd,
+                                           result.nmeasurements) == 0) {
+                if (result.job >= 0 && result.job < njobs &&
+                    !reported[result.job]) {
+                    reported[result.job] = 1;
+                    betatest_merge_result(&result);
+                }
+                if (betatest_stop_running()) {
+                    /* Let workers finish their current test, claim no more */
+                    __atomic_store_n(&shared[0], njobs, __ATOMIC_RELAXED);
+                }
+                continue;
+            }
+
+            /* Pipe closed: the worker is done or has died */
+            int status = 0;
+            close(fds[w].fd);
+            fds[w].fd = -1;
+            live--;
+            waitpid(pids[w], &status, 0);
+            int job = shared[1 + w];
+            if (job >= 0 && job < njobs && !reported[job]) {
+                reported[job] = 1;
+                betatest_worker_died(betatest_parallel.queue[job].test->name,
+                                     status);
+                if (betatest_stop_running()) {
+                    __atomic_store_n(&shared[0], njobs, __ATOMIC_RELAXED);
+                }
+            }
+            if (__atomic_load_n(&shared[0], __ATOMIC_RELAXED) < njobs) {
+                shared[1 + w] = -1;
+                fds[w].fd = betatest_spawn_worker(w, shared, shared + 1,
+                                                  &pids[w]);
+                if (fds[w].fd >= 0) {
+                    live++;
+                }
+            }
+        }
+    }
+
+    /* Anything never run (e.g. fork failed) runs in this process */
+    for (int i = 0; i < njobs; i++) {
+        if (reported[i]) {
+            continue;
+        }
+        if (betatest_stop_running()) {
+            betatest_options.not_run++;
+        } else {
+            betatest_execute_test(betatest_parallel.queue[i].test);
+        }
+    }
+
+    free(fds);
+    free(pids);
+    free(reported);
+    munmap(shared, (size_t)(workers + 1) * sizeof(int));
+    betatest_parallel.queue_len = 0;
+}
+
+BETATEST_FUNC void betatest_run_test(const betatest_test *test) {
+    if (betatest_parallel.collecting) {
+        betatest_parallel.requested++;
+    }
+    if (test->params != NULL && test->fn == NULL) {
+        betatest_build_cases(test);
+        for (size_t i = 0; i < test->params->ncases; i++) {
+            if (betatest_parallel.collecting) {
+                betatest_parallel_enqueue(&test->params->cases[i]);
+            } else if (betatest_stop_running()) {
+                betatest_options.not_run++;
+            } else {
+                betatest_execute_test(&test->params->cases[i]);
+            }
+        }
+        return;
+    }
+    if (!betatest_selected(test->name)) {
+        return;
+    }
+    if (betatest_parallel.collecting) {
+        betatest_parallel_enqueue(test);
+    } else if (betatest_stop_running()) {
+        betatest_options.not_run++;
+    } else {
+        betatest_execute_test(test);
+    }
+}
+
+/* Run every registered test of a suite, then tear the suite down */
+BETATEST_FUNC void betatest_run_suite(betatest_suite *suite) {
+    for (int i = 0; i < betatest_registry.count; i++) {
+        if (betatest_registry.tests[i].suite == suite) {
+            betatest_run_test(&betatest_registry.tests[i]);
+        }
+    }
+    if (!betatest_parallel.collecting) {
+        betatest_suite_leave(suite);
+    }
+}
+
+/* Test definition macros */
+#define TEST(name) TEST_TIMEOUT(name, BETATEST_TIMEOUT_DEFAULT)
+
+/* A test that is stopped and counted as timed out after `ms` milliseconds
+ * (0 = never, overriding BETATEST_TIMEOUT_MS and --timeout) */
+#define TEST_TIMEOUT(name, ms) BETATEST_DEFINE_TEST(name, #name, NULL, ms)
+
+#define BETATEST_DEFINE_TEST(id, name, suite, ms)                              \
+    static void test_##id(void);                                               \
+    static const betatest_test betatest_desc_##id = {                          \
+        name, test_##id, __FILE__, __LINE__, ms, suite, NULL, 0};              \
+    BETATEST_FUNC void run_test_##id(void) {                                   \
+        betatest_run_test(&betatest_desc_##id);                                \
+    }                                                                          \
+    __attribute__((constructor)) static void betatest_register_##id(void) {    \
+        betatest_register(&betatest_desc_##id);                                \
+    }                                                                          \
+    static void test_##id(void)
+
+#define RUN_TEST(name) run_test_##name()
+
+/* Suite definition macros
+ *
+ *     SUITE(db);
+ *     SUITE_SETUP(db) { table = load_fixture("big.db"); }
+ *     SUITE_TEARDOWN(db) { free_table(table); }
+ *     SETUP(db) { begin_transaction(table); }
+ *     TEARDOWN(db) { rollback(table); }
+ *     SUITE_TEST(db, insert) { ... }   // named "db.insert"
+ *
+ * Every hook is optional. Fixture state lives in file-scope variables. */
+#define SUITE(name)                                                            \
+    static betatest_suite betatest_suite_##name = {                            \
+        #name, NULL, NULL, NULL, NULL, 0, 0, 0, NULL}
+
+#define BETATEST_SUITE_HOOK(suite, hook)                                       \
+    static void betatest_##hook##_##suite(void);                               \
+    __attribute__((constructor)) static void betatest_##hook##_set_##suite(    \
+        void) {                                                                \
+        betatest_suite_##suite.hook = betatest_##hook##_##suite;               \
+    }                                                                          \
+    static void betatest_##hook##_##suite(void)
+
+#define SETUP(suite) BETATEST_SUITE_HOOK(suite, setup)
+#define TEARDOWN(suite) BETATEST_SUITE_HOOK(suite, teardown)
+#define SUITE_SETUP(suite) BETATEST_SUITE_HOOK(suite, suite_setup)
+#define SUITE_TEARDOWN(suite) BETATEST_SUITE_HOOK(suite, suite_teardown)
+
+#define SUITE_TEST(suite, name)                                                \
+    SUITE_TEST_TIMEOUT(suite, name, BETATEST_TIMEOUT_DEFAULT)
+
+#define SUITE_TEST_TIMEOUT(suite, name, ms)                                    \
+    BETATEST_DEFINE_TEST(suite##__##name, #suite "." #name,                    \
+                         &betatest_suite_##suite, ms)
+
+#define RUN_SUITE_TEST(suite, name) run_test_##suite##__##name()
+
+#define RUN_SUITE(suite) betatest_run_suite(&betatest_suite_##suite)
+
+/* Parameterized tests
+ *
+ *     typedef struct { uint8_t in[16]; uint8_t out[16]; } vector;
+ *     TEST_P(aes_block, vector) {
+ *         ASSERT_INT_EQ(memcmp(encrypt(param->in), param->out, 16), 0);
+ *     }
+ *     TEST_P_FILE(aes_block, "vectors/aes.bin");
+ *
+ * The body sees `const type *param` and `size_t case_index`. Every case is
+ * run and reported as its own test named "aes_block/<index>". The source of
+ * the cases is given after the body with one of
+ *
+ *     TEST_P_ARRAY(name, values)       a static array of `type`
+ *     TEST_P_FILE(name, path)          a binary file of packed `type` records
+ *     TEST_P_CSV(name, path, parse)    a text file, one case per line, where
+ *                                      int parse(const char *line, type *out)
+ *                                      returns 0 on success
+ *
+ * Files are memory-mapped, not read, when the test first runs. */
+#define TEST_P(name, type)                                                     \
+    typedef type betatest_ptype_##name;                                        \
+    static void test_##name(const type *param, size_t case_index);             \
+    static void betatest_pcall_##name(const void *param, size_t index) {       \
+        test_##name((const type *)param, index);                               \
+    }                                                                          \
+    static betatest_params betatest_params_##name;                             \
+    static const betatest_test betatest_desc_##name = {                        \
+        #name, NULL, __FILE__, __LINE__, BETATEST_TIMEOUT_DEFAULT,             \
+        NULL, &betatest_params_##name, 0};                                     \
+    BETATEST_FUNC void run_test_##name(void) {                                 \
+        betatest_run_test(&betatest_desc_##name);                              \
+    }                                                                          \
+    __attribute__((constructor)) static void betatest_register_##name(void) {  \
+        betatest_params_##name.size = sizeof(type);                            \
+        betatest_params_##name.call = betatest_pcall_##name;                   \
+        betatest_register(&betatest_desc_##name);                              \
+    }                                                                          \
+    static void test_##name(const type *param __attribute__((unused)),         \
+                            size_t case_index __attribute__((unused)))
+
+#define TEST_P_ARRAY(name, values)                                             \
+    __attribute__((constructor)) static void betatest_psource_##name(void) {   \
+        const betatest_ptype_##name *records = (values);                       \
+        betatest_params_##name.array = records;                                \
+        betatest_params_##name.count = sizeof(values) / sizeof((values)[0]);   \
+    }                                                                          \
+    typedef int betatest_psource_##name##_t
+
+#define TEST_P_FILE(name, file)                                                \
+    __attribute__((constructor)) static void betatest_psource_##name(void) {   \
+        betatest_params_##name.path = (file);                                  \
+    }                                                                          \
+    typedef int betatest_psource_##name##_t
+
+#define TEST_P_CSV(name, file, parse_fn)                                       \
+    static int betatest_pparse_##name(const char *line, void *out) {           \
+        return parse_fn(line, (betatest_ptype_##name *)out);                   \
+    }                                                                          \
+    __attribute__((constructor)) static void betatest_psource_##name(void) {   \
+        betatest_params_##name.path = (file);                                  \
+        betatest_params_##name.parse = betatest_pparse_##name;                 \
+    }                                                                          \
+    typedef int betatest_psource_##name##_t
+
+/* Run the RUN_TEST calls of the following block on a pool of `jobs` forked
+ * workers (0 = BETATEST_JOBS or the number of online CPUs):
+ *
+ *     RUN_ALL_TESTS_PARALLEL(8) {
+ *         RUN_TEST(a);
+ *         RUN_TEST(b);
+ *     }
+ *
+ * An empty block (RUN_ALL_TESTS_PARALLEL(8);) runs every registered test.
+ */
+#define RUN_ALL_TESTS_PARALLEL(jobs)                                           \
+    for (betatest_parallel_begin(jobs); betatest_parallel.collecting;          \
+         betatest_parallel_end())
+
+/* Benchmarks
+ *
+ * A BENCH body is one operation. The runner warms it up while calibrating
+ * the iteration count so that one sample takes about BETATEST_BENCH_SAMPLE_MS,
+ * then times BETATEST_BENCH_SAMPLES samples and reports ns/op statistics. */
+typedef void (*betatest_bench_fn)(long long iterations);
+
+typedef struct {
+    const char *name;
+    long long iterations;
+    int samples;
+    double min_ns;
+    double median_ns;
+    double mean_ns;
+    double p99_ns;
+    double stddev_ns;
+} betatest_bench_result;
+
+BETATEST_DATA struct {
+    betatest_bench_result *results;
+    int count;
+    int cap;
+} betatest_benches BETATEST_INIT({NULL, 0, 0});
+
+typedef struct {
+    const char *name;
+    betatest_bench_fn fn;
+} betatest_bench;
+
+BETATEST_DATA struct {
+    betatest_bench *benches;
+    int count;
+    int cap;
+} betatest_bench_registry BETATEST_INIT({NULL, 0, 0});
+
+/* Keep the compiler from discarding a value or the code computing it */
+#define BETATEST_DO_NOT_OPTIMIZE(x)                                            \
+    __asm__ __volatile__("" : : "r,m"(x) : "memory")
+
+/* Force pending memory writes to be treated as observable */
+#define BETATEST_CLOBBER() __asm__ __volatile__("" : : : "memory")
+
+BETATEST_FUNC void betatest_register_bench(const char *name,
+                                           betatest_bench_fn fn) {
+    if (betatest_grow(&betatest_bench_registry.benches,
+                      &betatest_bench_registry.cap,
+                      betatest_bench_registry.count,
+                      sizeof(betatest_bench)) != 0) {
+        return;
+    }
+    betatest_bench *b =
+        &betatest_bench_registry.benches[betatest_bench_registry.count++];
+    b->name = name;
+    b->fn = fn;
+}
+
+BETATEST_FUNC long long betatest_time_loop(betatest_bench_fn fn,
+                                           long long iterations) {
+    long long start = betatest_clock_ns(CLOCK_MONOTONIC);
+    fn(iterations);
+    return betatest_clock_ns(CLOCK_MONOTONIC) - start;
+}
+
+BETATEST_FUNC void betatest_run_bench(const char *name, betatest_bench_fn fn) {
+    if (!betatest_selected(name) || betatest_interrupted) {
+        return;
+    }
+    const long long warmup_ns = (long long)BETATEST_BENCH_WARMUP_MS * 1000000;
+    const long long target_ns = (long long)BETATEST_BENCH_SAMPLE_MS * 1000000;
+    const int nsamples = BETATEST_BENCH_SAMPLES > 0 ? BETATEST_BENCH_SAMPLES
+                                                    : 1;
+
+    /* Warmup doubles as calibration: grow the iteration count until one
+     * loop takes the target sample time, and keep going for the warmup */
+    long long iterations = 1;
+    long long warm_start = betatest_clock_ns(CLOCK_MONOTONIC);
+    for (;;) {
+        long long elapsed = betatest_time_loop(fn, iterations);
+        int calibrated = elapsed >= target_ns;
+        if (calibrated && betatest_clock_ns(CLOCK_MONOTONIC) - warm_start >=
+                              warmup_ns) {
+            break;
+        }
+        if (!calibrated) {
+            double scale = elapsed > 0 ? 1.2 * (double)target_ns / elapsed
+                                       : 10.0;
+            if (scale > 10.0) {
+                scale = 10.0;
+            }
+            long long next = (long long)((double)iterations * scale);
+            iterations = next > iterations ? next : iterations + 1;
+        }
+    }
+
+    double *samples = (double *)malloc((size_t)nsamples * sizeof(double));
+    if (samples == NULL) {
+        return;
+    }
+    int perf = betatest_perf_wanted();
+    betatest_perf_mark perf_mark;
+    betatest_perf_values perf_values;
+    if (perf) {
+        betatest_perf_begin(&perf_mark);
+    }
+    double sum = 0.0;
+    for (int i = 0; i < nsamples; i++) {
+        samples[i] = (double)betatest_time_loop(fn, iterations) / iterations;
+        sum += samples[i];
+    }
+    if (perf) {
+        betatest_perf_end(&perf_mark, &perf_values);
+    }
+    qsort(samples, (size_t)nsamples, sizeof(double), betatest_compare_double);
+
+    betatest_bench_result r;
+    r.name = name;
+    r.iterations = iterations;
+    r.samples = nsamples;
+    r.min_ns = samples[0];
+    r.median_ns = betatest_median(samples, nsamples);
+    r.mean_ns = sum / nsamples;
+    r.p99_ns = betatest_quantile(samples, nsamples, 0.99);
+    double var = 0.0;
+    for (int i = 0; i < nsamples; i++) {
+        var += (samples[i] - r.mean_ns) * (samples[i] - r.mean_ns);
+    }
+    r.stddev_ns = nsamples > 1 ? sqrt(var / (nsamples - 1)) : 0.0;
+    free(samples);
+
+    betatest_printf("%s[BENCH]%s %s: %.2f ns/op median (min %.2f, mean %.2f, "
+                    "p99 %.2f, sd %.2f; %d x %lld iterations)\n",
+                    BETATEST_COLOR_YELLOW, BETATEST_COLOR_RESET, name,
+                    r.median_ns, r.min_ns, r.mean_ns, r.p99_ns, r.stddev_ns,
+                    r.samples, r.iterations);
+    if (perf) {
+        betatest_print_perf(name, &perf_values,
+                            (double)nsamples * (double)iterations);
+    }
+    betatest_flush_output();
+    if (betatest_grow(&betatest_benches.results, &betatest_benches.cap,
+                      betatest_benches.count,
+                      sizeof(betatest_bench_result)) == 0) {
+        betatest_benches.results[betatest_benches.count++] = r;
+    }
+}
+
+BETATEST_FUNC void betatest_print_benches(void) {
+    if (betatest_benches.count == 0) {
+        return;
+    }
+    betatest_printf("%sBenchmarks (ns/op):%s\n", BETATEST_COLOR_BOLD,
+                    BETATEST_COLOR_RESET);
+    betatest_printf("  %10s %10s %10s %10s %10s  %s\n", "min", "median",
+                    "mean", "p99", "stddev", "benchmark");
+    for (int i = 0; i < betatest_benches.count; i++) {
+        const betatest_bench_result *r = &betatest_benches.results[i];
+        betatest_printf("  %10.2f %10.2f %10.2f %10.2f %10.2f  %s\n",
+                        r->min_ns, r->median_ns, r->mean_ns, r->p99_ns,
+                        r->stddev_ns, r->name);
+    }
+    betatest_printf("\n");
+}
+
+/* Define a benchmark whose body is a single operation:
+ *
+ *     BENCH(hash_small_key) {
+ *         BETATEST_DO_NOT_OPTIMIZE(hash("key", 3));
+ *     }
+ */
+#define BENCH(name)                                                            \
+    static inline void bench_##name(void);                                     \
+    static void bench_loop_##name(long long iterations) {                      \
+        for (long long i = 0; i < iterations; i++) {                           \
+            bench_##name();                                                    \
+        }                                                                      \
+    }                                                                          \
+    BETATEST_FUNC void run_bench_##name(void) {                                \
+        betatest_run_bench(#name, bench_loop_##name);                          \
+    }                                                                          \
+    __attribute__((constructor)) static void                                   \
+        betatest_register_bench_##name(void) {                                 \
+        betatest_register_bench(#name, bench_loop_##name);                     \
+    }                                                                          \
+    static inline void bench_##name(void)
+
+#define RUN_BENCH(name) run_bench_##name()
+
+/* Stress tests
+ *
+ * A STRESS_TEST body is one operation that every thread runs `iterations`
+ * times. The threads wait at a spinning start gate until all of them are
+ * up and are then released together. Each thread times its own loop; the
+ * run reports per-thread and total throughput and the spread between the
+ * fastest and the slowest thread. A thread count of BETATEST_STRESS_SWEEP
+ * runs the test once per count in 1, 2, 4 ... up to the online CPUs.
+ * Assertions in the threads count against the test, which joins them. */
+#define BETATEST_STRESS_SWEEP 0
 
-/* Color codes */
-#if BETATEST_USE_COLOR
-#define BETATEST_COLOR_GREEN "\033[32m"
-#define BETATEST_COLOR_RED "\033[31m"
-#define BETATEST_COLOR_YELLOW "\033[33m"
-#define BETATEST_COLOR_CYAN "\033[36m"
-#define BETATEST_COLOR_RESET "\033[0m"
-#define BETATEST_COLOR_BOLD "\033[1m"
+#if defined(__x86_64__) || defined(__i386__)
+#define BETATEST_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define BETATEST_CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
 #else
-#define BETATEST_COLOR_GREEN ""
-#define BETATEST_COLOR_RED ""
-#define BETATEST_COLOR_YELLOW ""
-#define BETATEST_COLOR_CYAN ""
-#define BETATEST_COLOR_RESET ""
-#define BETATEST_COLOR_BOLD ""
+#define BETATEST_CPU_RELAX() BETATEST_CLOBBER()
 #endif
 
-/* Test statistics */
-static struct {
-    int tests_run;
-    int tests_passed;
-    int tests_failed;
-    int assertions_run;
-    int assertions_passed;
-    int assertions_failed;
-    int current_test_failed;
-    char *current_test_name;
-} betatest_stats = {0, 0, 0, 0, 0, 0, 0, 0};
+typedef struct betatest_stress_worker betatest_stress_worker;
 
-/* Print helpers */
-#define BETATEST_PRINT_PASS()                                                  \
-    printf("%s[PASS]%s ", BETATEST_COLOR_GREEN, BETATEST_COLOR_RESET)
+typedef struct {
+    const char *name;
+    const char *file;
+    int line;
+    int threads;
+    long long iterations;
+    void (*loop)(betatest_stress_worker *worker);
+    void (*setup)(int threads);
+    void (*verify)(int threads, long long iterations);
+} betatest_stress;
 
-#define BETATEST_PRINT_FAIL()                                                  \
-    printf("%s[FAIL]%s ", BETATEST_COLOR_RED, BETATEST_COLOR_RESET)
+typedef struct {
+    int arrived;
+    int go;
+} betatest_stress_gate;
 
-#define BETATEST_PRINT_INFO()                                                  \
-    printf("%s[INFO]%s ", BETATEST_COLOR_CYAN, BETATEST_COLOR_RESET)
+struct betatest_stress_worker {
+    int thread;
+    long long iterations;
+    unsigned long jitter; /* 0 = never */
+    unsigned long rng;
+    long long start_ns;
+    long long end_ns;
+    const betatest_stress *stress;
+    betatest_stress_gate *gate;
+    pthread_t tid;
+};
 
-/* Test definition macros */
-#define TEST(name)                                                             \
-    static void test_##name(void);                                             \
-    static void run_test_##name(void) {                                        \
-        betatest_stats.current_test_name = #name;                              \
-        betatest_stats.tests_run++;                                            \
-        betatest_stats.current_test_failed = 0;                                \
-        int print_nl = 0;                                                      \
-        if (BETATEST_DO_PRINT_TEST) {                                          \
-            printf("%s%s[TEST]%s %s%s\n", BETATEST_COLOR_BOLD,                 \
-                   BETATEST_COLOR_CYAN, BETATEST_COLOR_RESET, #name,           \
-                   BETATEST_COLOR_RESET);                                      \
-            print_nl = 1;                                                      \
-        }                                                                      \
-        test_##name();                                                         \
-        if (betatest_stats.current_test_failed) {                              \
-            betatest_stats.tests_failed++;                                     \
-        } else {                                                               \
-            betatest_stats.tests_passed++;                                     \
-            if (BETATEST_DO_PRINT_PASS) {                                      \
-                BETATEST_PRINT_PASS();                                         \
-                printf("%s\n", #name);                                         \
-                print_nl = 1;                                                  \
-            }                                                                  \
-        }                                                                      \
-        if (print_nl) {                                                        \
-            printf("\n");                                                      \
+typedef struct {
+    const char *name;
+    int threads;
+    long long iterations;
+    double total_ops;    /* per second, over the whole run */
+    double min_ops;      /* per second, slowest thread */
+    double mean_ops;     /* per second, mean over threads */
+    double max_ops;      /* per second, fastest thread */
+    double imbalance;    /* (max_ops - min_ops) / max_ops */
+} betatest_stress_result;
+
+BETATEST_DATA struct {
+    betatest_stress_result *results;
+    int count;
+    int cap;
+} betatest_stress_results BETATEST_INIT({NULL, 0, 0});
+
+BETATEST_FUNC unsigned long betatest_stress_jitter(void) {
+    static long jitter = -1;
+    if (jitter < 0) {
+        const char *env = getenv("BETATEST_STRESS_JITTER");
+        jitter = env ? atol(env) : (long)BETATEST_STRESS_JITTER;
+        if (jitter < 0) {
+            jitter = 0;
+        }
+    }
+    return (unsigned long)jitter;
+}
+
+/* Yield the CPU, or spin for a few hundred cycles */
+BETATEST_COLD void betatest_stress_pause(betatest_stress_worker *worker) {
+    unsigned long r = betatest_random(&worker->rng);
+    if (r & 1) {
+        sched_yield();
+        return;
+    }
+    for (unsigned long i = (r >> 1) % 256; i > 0; i--) {
+        BETATEST_CPU_RELAX();
+    }
+}
+
+/* Called after every iteration of a STRESS_TEST body */
+static inline void betatest_stress_step(betatest_stress_worker *worker) {
+    if (worker->jitter != 0 &&
+        betatest_random(&worker->rng) % worker->jitter == 0) {
+        betatest_stress_pause(worker);
+    }
+}
+
+BETATEST_FUNC void *betatest_stress_thread(void *arg) {
+    betatest_stress_worker *worker = (betatest_stress_worker *)arg;
+    betatest_stress_gate *gate = worker->gate;
+    __atomic_add_fetch(&gate->arrived, 1, __ATOMIC_RELEASE);
+    for (unsigned spins = 1; !__atomic_load_n(&gate->go, __ATOMIC_ACQUIRE);
+         spins++) {
+        BETATEST_CPU_RELAX();
+        if (spins % 1024 == 0) {
+            sched_yield();
+        }
+    }
+    worker->start_ns = betatest_clock_ns(CLOCK_MONOTONIC);
+    worker->stress->loop(worker);
+    worker->end_ns = betatest_clock_ns(CLOCK_MONOTONIC);
+    return NULL;
+}
+
+/* Run `stress` once on `threads` threads and record its throughput */
+BETATEST_FUNC void betatest_stress_once(const betatest_stress *stress,
+                                        int threads) {
+    if (stress->setup != NULL) {
+        stress->setup(threads);
+    }
+    /* On the heap: a timed-out test leaves its threads running */
+    betatest_stress_gate *gate =
+        (betatest_stress_gate *)calloc(1, sizeof(*gate));
+    betatest_stress_worker *workers = (betatest_stress_worker *)calloc(
+        (size_t)threads, sizeof(*workers));
+    if (gate == NULL || workers == NULL) {
+        free(gate);
+        free(workers);
+        betatest_fail(stress->file, stress->line,
+                      "Cannot allocate %d stress threads", threads);
+        return;
+    }
+    unsigned long seed = (unsigned long)betatest_clock_ns(CLOCK_MONOTONIC);
+    int started = 0;
+    for (int t = 0; t < threads; t++) {
+        betatest_stress_worker *w = &workers[t];
+        w->thread = t;
+        w->iterations = stress->iterations;
+        w->jitter = betatest_stress_jitter();
+        w->rng = seed ^ (0x9e3779b97f4a7c15UL * (unsigned long)(t + 1));
+        w->stress = stress;
+        w->gate = gate;
+        int err = pthread_create(&w->tid, NULL, betatest_stress_thread, w);
+        if (err != 0) {
+            betatest_fail(stress->file, stress->line,
+                          "Cannot start stress thread %d of %d: %s", t + 1,
+                          threads, strerror(err));
+            break;
+        }
+        started++;
+    }
+    while (__atomic_load_n(&gate->arrived, __ATOMIC_ACQUIRE) < started) {
+        sched_yield();
+    }
+    long long start_ns = betatest_clock_ns(CLOCK_MONOTONIC);
+    __atomic_store_n(&gate->go, 1, __ATOMIC_RELEASE);
+    long long end_ns = start_ns;
+    double sum = 0.0;
+    double min_ops = 0.0;
+    double max_ops = 0.0;
+    betatest_printf("%s[STRESS]%s %s: %d thread%s x %lld iterations, per "
+                    "thread Mops/s:",
+                    BETATEST_COLOR_YELLOW, BETATEST_COLOR_RESET, stress->name,
+                    threads, threads == 1 ? "" : "s", stress->iterations);
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t].tid, NULL);
+        long long ns = workers[t].end_ns - workers[t].start_ns;
+        double ops = ns > 0 ? (double)stress->iterations * 1e9 / ns : 0.0;
+        betatest_printf(" %.3f", ops / 1e6);
+        sum += ops;
+        min_ops = t == 0 || ops < min_ops ? ops : min_ops;
+        max_ops = ops > max_ops ? ops : max_ops;
+        if (workers[t].end_ns > end_ns) {
+            end_ns = workers[t].end_ns;
+        }
+    }
+    free(workers);
+    free(gate);
+
+    betatest_stress_result r;
+    r.name = stress->name;
+    r.threads = started;
+    r.iterations = stress->iterations;
+    r.total_ops = end_ns > start_ns ? (double)started * stress->iterations *
+                                          1e9 / (double)(end_ns - start_ns)
+                                    : 0.0;
+    r.min_ops = min_ops;
+    r.mean_ops = started > 0 ? sum / started : 0.0;
+    r.max_ops = max_ops;
+    r.imbalance = max_ops > 0.0 ? (max_ops - min_ops) / max_ops : 0.0;
+    betatest_printf("\n         total %.3f Mops/s, imbalance %.1f%%\n",
+                    r.total_ops / 1e6, r.imbalance * 100.0);
+    betatest_flush_output();
+    if (betatest_grow(&betatest_stress_results.results,
+                      &betatest_stress_results.cap,
+                      betatest_stress_results.count,
+                      sizeof(betatest_stress_result)) == 0) {
+        betatest_stress_results.results[betatest_stress_results.count++] = r;
+    }
+    if (started > 0 && stress->verify != NULL) {
+        stress->verify(started, stress->iterations);
+    }
+}
+
+BETATEST_FUNC void betatest_run_stress(const betatest_stress *stress) {
+    if (stress->threads > 0) {
+        betatest_stress_once(stress, stress->threads);
+        return;
+    }
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    for (int threads = 1; threads < cpus; threads *= 2) {
+        betatest_stress_once(stress, threads);
+    }
+    betatest_stress_once(stress, cpus);
+}
+
+/* Throughput of every stress run, with the speedup over the same test's
+ * run on the fewest threads */
+BETATEST_FUNC void betatest_print_stress(void) {
+    if (betatest_stress_results.count == 0) {
+        return;
+    }
+    betatest_printf("%sStress tests (Mops/s):%s\n", BETATEST_COLOR_BOLD,
+                    BETATEST_COLOR_RESET);
+    betatest_printf("  %7s %10s %10s %10s %10s %9s %8s  %s\n", "threads",
+                    "total", "min", "mean", "max", "imbalance", "speedup",
+                    "test");
+    for (int i = 0; i < betatest_stress_results.count; i++) {
+        const betatest_stress_result *r = &betatest_stress_results.results[i];
+        const betatest_stress_result *base = r;
+        for (int j = 0; j < betatest_stress_results.count; j++) {
+            const betatest_stress_result *o =
+                &betatest_stress_results.results[j];
+            if (strcmp(o->name, r->name) == 0 && o->threads < base->threads) {
+                base = o;
+            }
+        }
+        betatest_printf("  %7d %10.3f %10.3f %10.3f %10.3f %8.1f%% %7.2fx  "
+                        "%s\n",
+                        r->threads, r->total_ops / 1e6, r->min_ops / 1e6,
+                        r->mean_ops / 1e6, r->max_ops / 1e6,
+                        r->imbalance * 100.0,
+                        base->total_ops > 0.0 ? r->total_ops / base->total_ops
+                                              : 0.0,
+                        r->name);
+    }
+    betatest_printf("\n");
+}
+
+/* Define a stress test whose body is one operation, run by every thread:
+ *
+ *     STRESS_TEST(queue_push_pop, BETATEST_STRESS_SWEEP, 100000) {
+ *         queue_push(&queue, thread);
+ *         ASSERT_TRUE(queue_pop(&queue) >= 0);
+ *     }
+ *
+ * `thread` is the thread's index and `iteration` the iteration number. */
+#define STRESS_TEST(name, nthreads, niterations)                               \
+    static inline void stress_##name(int thread, long long iteration);         \
+    static void betatest_stress_loop_##name(betatest_stress_worker *w) {       \
+        for (long long i = 0; i < w->iterations; i++) {                        \
+            stress_##name(w->thread, i);                                       \
+            betatest_stress_step(w);                                           \
         }                                                                      \
     }                                                                          \
-    static void test_##name(void)
+    static betatest_stress betatest_stress_##name = {                          \
+        #name, __FILE__, __LINE__, nthreads, niterations,                      \
+        betatest_stress_loop_##name, NULL, NULL};                              \
+    TEST(name) { betatest_run_stress(&betatest_stress_##name); }               \
+    static inline void stress_##name(int thread __attribute__((unused)),       \
+                                     long long iteration                       \
+                                     __attribute__((unused)))
 
-#define RUN_TEST(name) run_test_##name()
+#define BETATEST_STRESS_HOOK(name, hook, ...)                                  \
+    static void betatest_stress_##hook##_##name(__VA_ARGS__);                  \
+    __attribute__((constructor)) static void                                   \
+        betatest_stress_##hook##_set_##name(void) {                            \
+        betatest_stress_##name.hook = betatest_stress_##hook##_##name;         \
+    }                                                                          \
+    static void betatest_stress_##hook##_##name(__VA_ARGS__)
 
-/* Assertion helpers */
-#define BETATEST_RECORD_PASS()                                                 \
-    do {                                                                       \
-        betatest_stats.assertions_run++;                                       \
-        betatest_stats.assertions_passed++;                                    \
-    } while (0)
+/* Runs before each thread count of a STRESS_TEST, to reset shared state */
+#define STRESS_SETUP(name)                                                     \
+    BETATEST_STRESS_HOOK(name, setup, int threads __attribute__((unused)))
 
-#define BETATEST_RECORD_FAIL(msg, ...)                                         \
-    do {                                                                       \
-        betatest_stats.assertions_run++;                                       \
-        betatest_stats.assertions_failed++;                                    \
-        betatest_stats.current_test_failed = 1;                                \
-        if (BETATEST_DO_PRINT_FAIL) {                                          \
-            BETATEST_PRINT_FAIL();                                             \
-            printf("%s\n       ", betatest_stats.current_test_name);           \
-            printf(msg, ##__VA_ARGS__);                                        \
-            printf("\n       at %s:%d\n", __FILE__, __LINE__);                 \
-        }                                                                      \
-    } while (0)
+/* Runs after the threads of each run are joined, to check shared state */
+#define STRESS_VERIFY(name)                                                    \
+    BETATEST_STRESS_HOOK(name, verify, int threads __attribute__((unused)),    \
+                         long long iterations __attribute__((unused)))
 
 /* Core assertion macros */
 #define ASSERT_TRUE(cond)                                                      \
-    do {                                                                       \
-        if (cond) {                                                            \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL(                                              \
-                "Assertion failed: expected true, got false\n"                 \
-                "       Expression: %s",                                       \
-                #cond);                                                        \
-        }                                                                      \
-    } while (0)
+    BETATEST_CHECK(cond, betatest_fail_expr(__FILE__, __LINE__,                \
+                                            "expected true, got false", #cond))
 
 #define ASSERT_FALSE(cond)                                                     \
-    do {                                                                       \
-        if (!(cond)) {                                                         \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL(                                              \
-                "Assertion failed: expected false, got true\n"                 \
-                "       Expression: %s",                                       \
-                #cond);                                                        \
-        }                                                                      \
-    } while (0)
+    BETATEST_CHECK(!(cond),                                                    \
+                   betatest_fail_expr(__FILE__, __LINE__,                      \
+                                      "expected false, got true", #cond))
 
 #define ASSERT_EQ(a, b)                                                        \
-    do {                                                                       \
-        if ((a) == (b)) {                                                      \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: expected equal\n"          \
-                                 "       Expression: %s == %s",                \
-                                 #a, #b);                                      \
-        }                                                                      \
-    } while (0)
+    BETATEST_CHECK((a) == (b), betatest_fail_expr(__FILE__, __LINE__,          \
+                                                  "expected equal",            \
+                                                  #a " == " #b))
 
 #define ASSERT_NEQ(a, b)                                                       \
-    do {                                                                       \
-        if ((a) != (b)) {                                                      \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: expected not equal\n"      \
-                                 "       Expression: %s != %s",                \
-                                 #a, #b);                                      \
-        }                                                                      \
-    } while (0)
+    BETATEST_CHECK((a) != (b), betatest_fail_expr(__FILE__, __LINE__,          \
+                                                  "expected not equal",        \
+                                                  #a " != " #b))
 
 #define ASSERT_NULL(ptr)                                                       \
-    do {                                                                       \
-        if ((ptr) == NULL) {                                                   \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: expected NULL\n"           \
-                                 "       Expression: %s",                      \
-                                 #ptr);                                        \
-        }                                                                      \
-    } while (0)
+    BETATEST_CHECK((ptr) == NULL, betatest_fail_expr(__FILE__, __LINE__,       \
+                                                     "expected NULL", #ptr))
 
 #define ASSERT_NOT_NULL(ptr)                                                   \
-    do {                                                                       \
-        if ((ptr) != NULL) {                                                   \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: expected not NULL\n"       \
-                                 "       Expression: %s",                      \
-                                 #ptr);                                        \
-        }                                                                      \
-    } while (0)
+    BETATEST_CHECK((ptr) != NULL, betatest_fail_expr(__FILE__, __LINE__,       \
+                                                     "expected not NULL",      \
+                                                     #ptr))
 
 /* Integer comparison with value display */
 #define ASSERT_INT_EQ(a, b)                                                    \
     do {                                                                       \
         long long _a = (long long)(a);                                         \
         long long _b = (long long)(b);                                         \
-        if (_a == _b) {                                                        \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: integers not equal\n"      \
-                                 "       1:  %s = %lld\n"                      \
-                                 "       2:  %s = %lld",                       \
-                                 #a, _a, #b, _b);                              \
-        }                                                                      \
+        BETATEST_CHECK(_a == _b,                                               \
+                       betatest_fail_int(__FILE__, __LINE__,                   \
+                                         "integers not equal", #a, _a, #b,     \
+                                         _b));                                 \
     } while (0)
 
 #define ASSERT_INT_NEQ(a, b)                                                   \
     do {                                                                       \
         long long _a = (long long)(a);                                         \
         long long _b = (long long)(b);                                         \
-        if (_a != _b) {                                                        \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL(                                              \
-                "Assertion failed: integers should not be equal\n"             \
-                "       Both: %lld",                                           \
-                _a);                                                           \
-        }                                                                      \
+        BETATEST_CHECK(_a != _b,                                               \
+                       betatest_fail_int(__FILE__, __LINE__,                   \
+                                         "integers should not be equal", #a,   \
+                                         _a, NULL, _b));                       \
     } while (0)
 
 /* String comparison */
@@ -227,36 +4722,22 @@ static struct {
     do {                                                                       \
         const char *_s1 = (s1);                                                \
         const char *_s2 = (s2);                                                \
-        if (_s1 == NULL && _s2 == NULL) {                                      \
-            BETATEST_RECORD_PASS();                                            \
-        } else if (_s1 == NULL || _s2 == NULL) {                               \
-            BETATEST_RECORD_FAIL("Assertion failed: one string is NULL\n"      \
-                                 "       %s = %s\n"                            \
-                                 "       %s = %s",                             \
-                                 #s1, _s1 ? _s1 : "NULL", #s2,                 \
-                                 _s2 ? _s2 : "NULL");                          \
-        } else if (strcmp(_s1, _s2) == 0) {                                    \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: strings not equal\n"       \
-                                 "       1:  %s = \"%s\"\n"                    \
-                                 "       2:  %s = \"%s\"\n",                   \
-                                 #s1, _s1, #s2, _s2);                          \
-        }                                                                      \
+        BETATEST_CHECK(_s1 == _s2 || (_s1 && _s2 && strcmp(_s1, _s2) == 0),    \
+                       betatest_fail_str(__FILE__, __LINE__,                   \
+                                         _s1 && _s2 ? "strings not equal"      \
+                                                    : "one string is NULL",    \
+                                         "1:  ", #s1, _s1, "2:  ", #s2, _s2)); \
     } while (0)
 
 #define ASSERT_STR_NEQ(s1, s2)                                                 \
     do {                                                                       \
         const char *_s1 = (s1);                                                \
         const char *_s2 = (s2);                                                \
-        if (_s1 == NULL || _s2 == NULL || strcmp(_s1, _s2) != 0) {             \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL(                                              \
-                "Assertion failed: strings should not be equal\n"              \
-                "       Both: \"%s\"",                                         \
-                _s1);                                                          \
-        }                                                                      \
+        BETATEST_CHECK(_s1 == NULL || _s2 == NULL || strcmp(_s1, _s2) != 0,    \
+                       betatest_fail_str(__FILE__, __LINE__,                   \
+                                         "strings should not be equal",        \
+                                         "Both: ", NULL, _s1, NULL, NULL,      \
+                                         NULL));                               \
     } while (0)
 
 /* String contains substring */
@@ -264,21 +4745,14 @@ static struct {
     do {                                                                       \
         const char *_str = (str);                                              \
         const char *_substr = (substr);                                        \
-        if (_str == NULL || _substr == NULL) {                                 \
-            BETATEST_RECORD_FAIL("Assertion failed: one string is NULL\n"      \
-                                 "       %s = %s\n"                            \
-                                 "       %s = %s",                             \
-                                 #str, _str ? _str : "NULL", #substr,          \
-                                 _substr ? _substr : "NULL");                  \
-        } else if (strstr(_str, _substr) != NULL) {                            \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL(                                              \
-                "Assertion failed: string does not contain substring\n"        \
-                "       String:    %s = \"%s\"\n"                              \
-                "       Substring: %s = \"%s\"",                               \
-                #str, _str, #substr, _substr);                                 \
-        }                                                                      \
+        BETATEST_CHECK(_str && _substr && strstr(_str, _substr) != NULL,       \
+                       betatest_fail_str(                                      \
+                           __FILE__, __LINE__,                                 \
+                           _str && _substr                                     \
+                               ? "string does not contain substring"           \
+                               : "one string is NULL",                         \
+                           "String:    ", #str, _str, "Substring: ", #substr,  \
+                           _substr));                                          \
     } while (0)
 
 /* String starts with prefix */
@@ -286,24 +4760,15 @@ static struct {
     do {                                                                       \
         const char *_str = (str);                                              \
         const char *_prefix = (prefix);                                        \
-        if (_str == NULL || _prefix == NULL) {                                 \
-            BETATEST_RECORD_FAIL("Assertion failed: one string is NULL\n"      \
-                                 "       %s = %s\n"                            \
-                                 "       %s = %s",                             \
-                                 #str, _str ? _str : "NULL", #prefix,          \
-                                 _prefix ? _prefix : "NULL");                  \
-        } else {                                                               \
-            size_t prefix_len = strlen(_prefix);                               \
-            if (strncmp(_str, _prefix, prefix_len) == 0) {                     \
-                BETATEST_RECORD_PASS();                                        \
-            } else {                                                           \
-                BETATEST_RECORD_FAIL(                                          \
-                    "Assertion failed: string does not start with prefix\n"    \
-                    "       String: %s = \"%s\"\n"                             \
-                    "       Prefix: %s = \"%s\"",                              \
-                    #str, _str, #prefix, _prefix);                             \
-            }                                                                  \
-        }                                                                      \
+        BETATEST_CHECK(_str && _prefix &&                                      \
+                           strncmp(_str, _prefix, strlen(_prefix)) == 0,       \
+                       betatest_fail_str(                                      \
+                           __FILE__, __LINE__,                                 \
+                           _str && _prefix                                     \
+                               ? "string does not start with prefix"           \
+                               : "one string is NULL",                         \
+                           "String: ", #str, _str, "Prefix: ", #prefix,        \
+                           _prefix));                                          \
     } while (0)
 
 /* String ends with suffix */
@@ -311,98 +4776,378 @@ static struct {
     do {                                                                       \
         const char *_str = (str);                                              \
         const char *_suffix = (suffix);                                        \
-        if (_str == NULL || _suffix == NULL) {                                 \
-            BETATEST_RECORD_FAIL("Assertion failed: one string is NULL\n"      \
-                                 "       %s = %s\n"                            \
-                                 "       %s = %s",                             \
-                                 #str, _str ? _str : "NULL", #suffix,          \
-                                 _suffix ? _suffix : "NULL");                  \
-        } else {                                                               \
-            size_t str_len = strlen(_str);                                     \
-            size_t suffix_len = strlen(_suffix);                               \
-            if (suffix_len <= str_len &&                                       \
-                strcmp(_str + str_len - suffix_len, _suffix) == 0) {           \
-                BETATEST_RECORD_PASS();                                        \
-            } else {                                                           \
-                BETATEST_RECORD_FAIL(                                          \
-                    "Assertion failed: string does not end with suffix\n"      \
-                    "       String: %s = \"%s\"\n"                             \
-                    "       Suffix: %s = \"%s\"",                              \
-                    #str, _str, #suffix, _suffix);                             \
-            }                                                                  \
-        }                                                                      \
+        size_t _str_len = _str ? strlen(_str) : 0;                             \
+        size_t _suffix_len = _suffix ? strlen(_suffix) : 0;                    \
+        BETATEST_CHECK(_str && _suffix && _suffix_len <= _str_len &&           \
+                           strcmp(_str + _str_len - _suffix_len, _suffix) ==   \
+                               0,                                              \
+                       betatest_fail_str(                                      \
+                           __FILE__, __LINE__,                                 \
+                           _str && _suffix                                     \
+                               ? "string does not end with suffix"             \
+                               : "one string is NULL",                         \
+                           "String: ", #str, _str, "Suffix: ", #suffix,        \
+                           _suffix));                                          \
     } while (0)
 
 /* String is empty */
 #define ASSERT_STR_EMPTY(str)                                                  \
     do {                                                                       \
         const char *_str = (str);                                              \
-        if (_str == NULL) {                                                    \
-            BETATEST_RECORD_FAIL("Assertion failed: string is NULL\n"          \
-                                 "       %s = NULL",                           \
-                                 #str);                                        \
-        } else if (_str[0] == '\0') {                                          \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: string is not empty\n"     \
-                                 "       %s = \"%s\"",                         \
-                                 #str, _str);                                  \
-        }                                                                      \
+        BETATEST_CHECK(_str && _str[0] == '\0',                                \
+                       betatest_fail_str(__FILE__, __LINE__,                   \
+                                         _str ? "string is not empty"          \
+                                              : "string is NULL",              \
+                                         "", #str, _str, NULL, NULL, NULL));   \
     } while (0)
 
 /* String is not empty */
 #define ASSERT_STR_NOT_EMPTY(str)                                              \
     do {                                                                       \
         const char *_str = (str);                                              \
-        if (_str == NULL) {                                                    \
-            BETATEST_RECORD_FAIL("Assertion failed: string is NULL\n"          \
-                                 "       %s = NULL",                           \
-                                 #str);                                        \
-        } else if (_str[0] != '\0') {                                          \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: string is empty\n"         \
-                                 "       %s = \"\"",                           \
-                                 #str);                                        \
-        }                                                                      \
+        BETATEST_CHECK(_str && _str[0] != '\0',                                \
+                       betatest_fail_str(__FILE__, __LINE__,                   \
+                                         _str ? "string is empty"              \
+                                              : "string is NULL",              \
+                                         "", #str, _str, NULL, NULL, NULL));   \
     } while (0)
 
-/* String matches regex pattern */
+/* Compiled regex cache
+ *
+ * ASSERT_STR_MATCHES and friends look patterns up here instead of compiling
+ * them on every evaluation. Entries are keyed by pattern text and cflags,
+ * compile errors are cached too, and everything is freed by TEST_SUMMARY
+ * and TEST_RESET. */
+typedef struct {
+    char *pattern;
+    int cflags;
+    unsigned long hash;
+    int error;
+    char errmsg[128];
+    regex_t regex;
+} betatest_regex_entry;
+
+BETATEST_DATA struct {
+    betatest_regex_entry **slots;
+    int cap;
+    int count;
+    long hits;
+    long misses;
+    pthread_mutex_t lock;
+} betatest_regex_cache BETATEST_INIT({NULL, 0, 0, 0, 0,
+                                       PTHREAD_MUTEX_INITIALIZER});
+
+BETATEST_FUNC int betatest_regex_cache_grow(void) {
+    int cap = betatest_regex_cache.cap ? betatest_regex_cache.cap * 2 : 64;
+    betatest_regex_entry **slots =
+        (betatest_regex_entry **)calloc((size_t)cap, sizeof(*slots));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < betatest_regex_cache.cap; i++) {
+        betatest_regex_entry *e = betatest_regex_cache.slots[i];
+        if (e != NULL) {
+            int j = (int)(e->hash & (unsigned long)(cap - 1));
+            while (slots[j] != NULL) {
+                j = (j + 1) & (cap - 1);
+            }
+            slots[j] = e;
+        }
+    }
+    free(betatest_regex_cache.slots);
+    betatest_regex_cache.slots = slots;
+    betatest_regex_cache.cap = cap;
+    return 0;
+}
+
+/* Look up or compile a pattern. Returns NULL and fills errbuf when the
+ * pattern does not compile. Callers hold betatest_regex_cache.lock. */
+BETATEST_FUNC const regex_t *betatest_regex_lookup(const char *pattern,
+                                                   int cflags, char *errbuf,
+                                                   size_t errlen) {
+    unsigned long hash = betatest_hash_str(pattern, 14695981039346656037UL) ^
+                         (unsigned long)cflags * 0x9e3779b97f4a7c15UL;
+    int mask = betatest_regex_cache.cap - 1;
+    int i = (int)(hash & (unsigned long)mask);
+    while (betatest_regex_cache.cap > 0 && betatest_regex_cache.slots[i]) {
+        betatest_regex_entry *e = betatest_regex_cache.slots[i];
+        if (e->hash == hash && e->cflags == cflags &&
+            strcmp(e->pattern, pattern) == 0) {
+            betatest_regex_cache.hits++;
+            if (e->error) {
+                snprintf(errbuf, errlen, "%s", e->errmsg);
+                return NULL;
+            }
+            return &e->regex;
+        }
+        i = (i + 1) & mask;
+    }
+
+    betatest_regex_cache.misses++;
+    betatest_regex_entry *e =
+        (betatest_regex_entry *)calloc(1, sizeof(betatest_regex_entry));
+    size_t len = strlen(pattern);
+    char *copy = (char *)malloc(len + 1);
+    if (e == NULL || copy == NULL) {
+        free(e);
+        free(copy);
+        snprintf(errbuf, errlen, "out of memory");
+        return NULL;
+    }
+    memcpy(copy, pattern, len + 1);
+    e->pattern = copy;
+    e->cflags = cflags;
+    e->hash = hash;
+    e->error = regcomp(&e->regex, pattern, cflags);
+    if (e->error != 0) {
+        regerror(e->error, &e->regex, e->errmsg, sizeof(e->errmsg));
+        snprintf(errbuf, errlen, "%s", e->errmsg);
+    }
+
+    /* Keep the load factor under 1/2 */
+    if ((betatest_regex_cache.count + 1) * 2 > betatest_regex_cache.cap &&
+        betatest_regex_cache_grow() != 0) {
+        if (e->error == 0) {
+            regfree(&e->regex);
+        }
+        free(e->pattern);
+        free(e);
+        snprintf(errbuf, errlen, "out of memory");
+        return NULL;
+    }
+    mask = betatest_regex_cache.cap - 1;
+    i = (int)(hash & (unsigned long)mask);
+    while (betatest_regex_cache.slots[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+    betatest_regex_cache.slots[i] = e;
+    betatest_regex_cache.count++;
+    return e->error ? NULL : &e->regex;
+}
+
+/* Thread-safe betatest_regex_lookup. regexec on the returned pattern needs
+ * no lock; the cache is only freed by TEST_SUMMARY and TEST_RESET. */
+BETATEST_FUNC const regex_t *betatest_regex_get(const char *pattern,
+                                                int cflags, char *errbuf,
+                                                size_t errlen) {
+    betatest_lock(&betatest_regex_cache.lock);
+    const regex_t *regex =
+        betatest_regex_lookup(pattern, cflags, errbuf, errlen);
+    betatest_unlock(&betatest_regex_cache.lock);
+    return regex;
+}
+
+/* Free every cached pattern; the hit/miss counters are kept */
+BETATEST_FUNC void betatest_regex_cache_free(void) {
+    for (int i = 0; i < betatest_regex_cache.cap; i++) {
+        betatest_regex_entry *e = betatest_regex_cache.slots[i];
+        if (e != NULL) {
+            if (e->error == 0) {
+                regfree(&e->regex);
+            }
+            free(e->pattern);
+            free(e);
+        }
+    }
+    free(betatest_regex_cache.slots);
+    betatest_regex_cache.slots = NULL;
+    betatest_regex_cache.cap = 0;
+    betatest_regex_cache.count = 0;
+}
+
+/* Outcome of a regex assertion */
+enum {
+    BETATEST_REGEX_OK,
+    BETATEST_REGEX_NULL,         /* an argument is NULL */
+    BETATEST_REGEX_BAD_GROUP,    /* capture group out of range */
+    BETATEST_REGEX_BAD_PATTERN,  /* the pattern does not compile */
+    BETATEST_REGEX_NO_MATCH,
+    BETATEST_REGEX_GROUP_DIFFERS /* matched, but the group is different */
+};
+
+/* Match `str` against the POSIX ERE `pattern` (plus extra cflags), filling
+ * groups[0..ngroups-1] on a match. errbuf gets the error of a bad pattern. */
+BETATEST_FUNC int betatest_regex_check(const char *str, const char *pattern,
+                                       int cflags, regmatch_t *groups,
+                                       size_t ngroups, char *errbuf,
+                                       size_t errlen) {
+    if (str == NULL || pattern == NULL) {
+        return BETATEST_REGEX_NULL;
+    }
+    const regex_t *regex =
+        betatest_regex_get(pattern, REG_EXTENDED | cflags, errbuf, errlen);
+    if (regex == NULL) {
+        return BETATEST_REGEX_BAD_PATTERN;
+    }
+    return regexec(regex, str, ngroups, groups, 0) == 0
+               ? BETATEST_REGEX_OK
+               : BETATEST_REGEX_NO_MATCH;
+}
+
+/* Match `str` against `pattern` and compare capture group `group` (0-9)
+ * with `expected`. groups needs room for 10 entries. */
+BETATEST_FUNC int betatest_regex_group_check(const char *str,
+                                             const char *pattern, int group,
+                                             const char *expected,
+                                             regmatch_t *groups, char *errbuf,
+                                             size_t errlen) {
+    if (str == NULL || pattern == NULL || expected == NULL) {
+        return BETATEST_REGEX_NULL;
+    }
+    if (group < 0 || group > 9) {
+        return BETATEST_REGEX_BAD_GROUP;
+    }
+    int rc = betatest_regex_check(str, pattern, 0, groups, 10, errbuf, errlen);
+    if (rc != BETATEST_REGEX_OK) {
+        return rc;
+    }
+    size_t len = strlen(expected);
+    const regmatch_t *g = &groups[group];
+    if (g->rm_so >= 0 && (size_t)(g->rm_eo - g->rm_so) == len &&
+        strncmp(str + g->rm_so, expected, len) == 0) {
+        return BETATEST_REGEX_OK;
+    }
+    return BETATEST_REGEX_GROUP_DIFFERS;
+}
+
+BETATEST_FUNC int betatest_regex_group_eq(const char *str, const char *pattern,
+                                          int group, const char *expected) {
+    regmatch_t groups[10];
+    return betatest_regex_group_check(str, pattern, group, expected, groups,
+                                      NULL, 0) == BETATEST_REGEX_OK;
+}
+
+/* String matches regex pattern (POSIX ERE plus extra cflags such as
+ * REG_ICASE or REG_NEWLINE) */
+#define ASSERT_STR_MATCHES_FLAGS(str, pattern, cflags)                         \
+    ASSERT_STR_MATCHES_CAPTURE(str, pattern, cflags, NULL, 0)
+
 #define ASSERT_STR_MATCHES(str, pattern)                                       \
+    ASSERT_STR_MATCHES_FLAGS(str, pattern, 0)
+
+#define ASSERT_STR_MATCHES_ICASE(str, pattern)                                 \
+    ASSERT_STR_MATCHES_FLAGS(str, pattern, REG_ICASE)
+
+/* Like ASSERT_STR_MATCHES_FLAGS, and on a match fills groups[0..ngroups-1]
+ * with the offsets of the whole match and of each capture group */
+#define ASSERT_STR_MATCHES_CAPTURE(str, pattern, cflags, groups, ngroups)      \
     do {                                                                       \
         const char *_str = (str);                                              \
         const char *_pattern = (pattern);                                      \
-        if (_str == NULL || _pattern == NULL) {                                \
-            BETATEST_RECORD_FAIL("Assertion failed: string or pattern is NULL\n" \
-                                 "       %s = %s\n"                            \
-                                 "       %s = %s",                             \
-                                 #str, _str ? _str : "NULL", #pattern,         \
-                                 _pattern ? _pattern : "NULL");                \
-        } else {                                                               \
-            regex_t _regex;                                                    \
-            int _regex_err = regcomp(&_regex, _pattern, REG_EXTENDED);         \
-            if (_regex_err != 0) {                                             \
-                char _errbuf[256];                                             \
-                regerror(_regex_err, &_regex, _errbuf, sizeof(_errbuf));       \
-                BETATEST_RECORD_FAIL(                                          \
-                    "Assertion failed: regex compilation error\n"              \
-                    "       Pattern: %s = \"%s\"\n"                            \
-                    "       Error:   %s",                                      \
-                    #pattern, _pattern, _errbuf);                              \
-            } else {                                                           \
-                int _match_result = regexec(&_regex, _str, 0, NULL, 0);       \
-                regfree(&_regex);                                              \
-                if (_match_result == 0) {                                      \
-                    BETATEST_RECORD_PASS();                                    \
-                } else {                                                       \
-                    BETATEST_RECORD_FAIL(                                      \
-                        "Assertion failed: string does not match pattern\n"    \
-                        "       String:  %s = \"%s\"\n"                        \
-                        "       Pattern: %s = \"%s\"",                         \
-                        #str, _str, #pattern, _pattern);                       \
-                }                                                              \
-            }                                                                  \
-        }                                                                      \
+        int _cflags = (cflags);                                                \
+        BETATEST_CHECK(betatest_regex_check(_str, _pattern, _cflags, (groups), \
+                                            (size_t)(ngroups), NULL,           \
+                                            0) == BETATEST_REGEX_OK,           \
+                       betatest_fail_regex(__FILE__, __LINE__, #str, _str,     \
+                                           #pattern, _pattern, _cflags, 0,     \
+                                           NULL, NULL));                       \
+    } while (0)
+
+/* Describe every capture group of a match, one per line */
+BETATEST_FUNC const char *betatest_format_groups(char *buf, size_t size,
+                                                 const char *str,
+                                                 const regmatch_t *groups,
+                                                 int n) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < n && len < size; i++) {
+        int w;
+        if (groups[i].rm_so < 0) {
+            w = snprintf(buf + len, size - len, "\n       Group %d: (no match)",
+                         i);
+        } else {
+            w = snprintf(buf + len, size - len, "\n       Group %d: \"%.*s\"",
+                         i, (int)(groups[i].rm_eo - groups[i].rm_so),
+                         str + groups[i].rm_so);
+        }
+        if (w < 0) {
+            break;
+        }
+        len += (size_t)w;
+    }
+    return buf;
+}
+
+/* Report a failed regex assertion, checking again to find out why.
+ * `expected_expr` is NULL for ASSERT_STR_MATCHES_CAPTURE. */
+BETATEST_COLD void betatest_fail_regex(const char *file, int line,
+                                       const char *str_expr, const char *str,
+                                       const char *pattern_expr,
+                                       const char *pattern, int cflags,
+                                       int group, const char *expected_expr,
+                                       const char *expected) {
+    char errbuf[128] = "";
+    regmatch_t groups[10];
+    int rc = expected_expr == NULL
+                 ? betatest_regex_check(str, pattern, cflags, NULL, 0, errbuf,
+                                        sizeof(errbuf))
+                 : betatest_regex_group_check(str, pattern, group, expected,
+                                              groups, errbuf, sizeof(errbuf));
+    if (rc == BETATEST_REGEX_NULL && expected_expr == NULL) {
+        betatest_fail(file, line,
+                      "Assertion failed: string or pattern is NULL\n"
+                      "       %s = %s\n"
+                      "       %s = %s",
+                      str_expr, str ? str : "NULL", pattern_expr,
+                      pattern ? pattern : "NULL");
+    } else if (rc == BETATEST_REGEX_NULL) {
+        betatest_fail(file, line,
+                      "Assertion failed: string, pattern or expected is "
+                      "NULL\n"
+                      "       %s = %s\n"
+                      "       %s = %s\n"
+                      "       %s = %s",
+                      str_expr, str ? str : "NULL", pattern_expr,
+                      pattern ? pattern : "NULL", expected_expr,
+                      expected ? expected : "NULL");
+    } else if (rc == BETATEST_REGEX_BAD_GROUP) {
+        betatest_fail(file, line,
+                      "Assertion failed: capture group %d is out of range "
+                      "(0-9)",
+                      group);
+    } else if (rc == BETATEST_REGEX_BAD_PATTERN) {
+        betatest_fail(file, line,
+                      "Assertion failed: regex compilation error\n"
+                      "       Pattern: %s = \"%s\"\n"
+                      "       Error:   %s",
+                      pattern_expr, pattern, errbuf);
+    } else if (rc == BETATEST_REGEX_NO_MATCH || expected_expr == NULL) {
+        betatest_fail(file, line,
+                      "Assertion failed: string does not match pattern\n"
+                      "       String:  %s = \"%s\"\n"
+                      "       Pattern: %s = \"%s\"",
+                      str_expr, str, pattern_expr, pattern);
+    } else {
+        const regex_t *regex =
+            betatest_regex_get(pattern, REG_EXTENDED, NULL, 0);
+        int n = regex != NULL && regex->re_nsub < 10
+                    ? (int)regex->re_nsub + 1
+                    : 10;
+        char groupbuf[512];
+        betatest_fail(file, line,
+                      "Assertion failed: capture group %d not equal\n"
+                      "       String:   %s = \"%s\"\n"
+                      "       Pattern:  %s = \"%s\"\n"
+                      "       Expected: %s = \"%s\"%s",
+                      group, str_expr, str, pattern_expr, pattern,
+                      expected_expr, expected,
+                      betatest_format_groups(groupbuf, sizeof(groupbuf), str,
+                                             groups, n));
+    }
+}
+
+/* String matches pattern and capture group `group` (1-9) equals
+ * `expected`; on failure every group of the match is printed */
+#define ASSERT_STR_GROUP_EQ(str, pattern, group, expected)                     \
+    do {                                                                       \
+        const char *_str = (str);                                              \
+        const char *_pattern = (pattern);                                      \
+        const char *_expected = (expected);                                    \
+        int _group = (group);                                                  \
+        BETATEST_CHECK(                                                        \
+            betatest_regex_group_eq(_str, _pattern, _group, _expected),        \
+            betatest_fail_regex(__FILE__, __LINE__, #str, _str, #pattern,      \
+                                _pattern, 0, _group, #expected, _expected));   \
     } while (0)
 
 /* Float/double comparison with epsilon */
@@ -411,106 +5156,1473 @@ static struct {
         double _a = (double)(a);                                               \
         double _b = (double)(b);                                               \
         double _epsilon = (double)(epsilon);                                   \
-        if (fabs(_a - _b) <= _epsilon) {                                       \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL(                                              \
-                "Assertion failed: floats not equal within epsilon\n"          \
-                "       Got:      %s = %.10g\n"                                \
-                "       Expected: %s = %.10g\n"                                \
-                "       Epsilon:  %.10g\n"                                     \
-                "       Diff:     %.10g",                                      \
-                #a, _a, #b, _b, _epsilon, fabs(_a - _b));                      \
+        BETATEST_CHECK(fabs(_a - _b) <= _epsilon,                              \
+                       betatest_fail_float(__FILE__, __LINE__, #a, _a, #b, _b, \
+                                           _epsilon));                         \
+    } while (0)
+
+/* Bulk comparisons
+ *
+ * The buffer and array assertions compare whole blocks at a time using GCC
+ * vector extensions, which become SSE/AVX/NEON code where the target has it
+ * and plain scalar code elsewhere. Only blocks that differ are walked element
+ * by element, to find the first mismatch and count all of them. Each call is
+ * one assertion however long the arrays are. */
+#ifndef BETATEST_VECTOR_BYTES
+#if defined(__AVX__)
+#define BETATEST_VECTOR_BYTES 32
+#else
+#define BETATEST_VECTOR_BYTES 16
+#endif
+#endif
+
+typedef long long betatest_vi64
+    __attribute__((vector_size(BETATEST_VECTOR_BYTES)));
+typedef double betatest_vf64
+    __attribute__((vector_size(BETATEST_VECTOR_BYTES)));
+
+typedef struct {
+    size_t first;      /* index of the first mismatching element */
+    size_t mismatches; /* number of mismatching elements */
+} betatest_diff;
+
+/* Whether an integer expression has a signed type */
+#define BETATEST_IS_SIGNED(x) ((__typeof__(x))-1 < 1)
+
+/* Whether the next BETATEST_VECTOR_BYTES bytes of a and b are equal */
+static inline int betatest_block_equal(const char *a, const char *b) {
+    betatest_vi64 va;
+    betatest_vi64 vb;
+    memcpy(&va, a, sizeof(va));
+    memcpy(&vb, b, sizeof(vb));
+    betatest_vi64 x = va ^ vb;
+    long long any = 0;
+    for (size_t i = 0; i < sizeof(x) / sizeof(x[0]); i++) {
+        any |= x[i];
+    }
+    return any == 0;
+}
+
+BETATEST_FUNC void betatest_diff_add(betatest_diff *diff, size_t index) {
+    if (diff->mismatches++ == 0) {
+        diff->first = index;
+    }
+}
+
+/* Compare n elements of `size` bytes each. Returns the number that differ. */
+BETATEST_FUNC size_t betatest_bytes_diff(const void *a, const void *b, size_t n,
+                                         size_t size, betatest_diff *diff) {
+    const char *pa = (const char *)a;
+    const char *pb = (const char *)b;
+    diff->first = 0;
+    diff->mismatches = 0;
+    if (n == 0 || pa == pb) {
+        return 0;
+    }
+    if (pa == NULL || pb == NULL) {
+        diff->mismatches = n;
+        return n;
+    }
+    size_t len = n * size;
+    size_t pos = 0;
+    if (BETATEST_VECTOR_BYTES % size == 0) {
+        for (; pos + BETATEST_VECTOR_BYTES <= len;
+             pos += BETATEST_VECTOR_BYTES) {
+            if (__builtin_expect(betatest_block_equal(pa + pos, pb + pos), 1)) {
+                continue;
+            }
+            for (size_t i = pos; i < pos + BETATEST_VECTOR_BYTES; i += size) {
+                if (memcmp(pa + i, pb + i, size) != 0) {
+                    betatest_diff_add(diff, i / size);
+                }
+            }
+        }
+    }
+    for (size_t i = pos; i < len; i += size) {
+        if (memcmp(pa + i, pb + i, size) != 0) {
+            betatest_diff_add(diff, i / size);
+        }
+    }
+    return diff->mismatches;
+}
+
+/* Distance between two floats in units in the last place */
+BETATEST_FUNC unsigned long long betatest_ulps(double x, double y,
+                                               int is_double) {
+    unsigned long long ux;
+    unsigned long long uy;
+    unsigned long long sign;
+    if (is_double) {
+        memcpy(&ux, &x, sizeof(ux));
+        memcpy(&uy, &y, sizeof(uy));
+        sign = 1ULL << 63;
+    } else {
+        float fx = (float)x;
+        float fy = (float)y;
+        unsigned int ix;
+        unsigned int iy;
+        memcpy(&ix, &fx, sizeof(ix));
+        memcpy(&iy, &fy, sizeof(iy));
+        ux = ix;
+        uy = iy;
+        sign = 1ULL << 31;
+    }
+    /* Map sign-magnitude bits onto one increasing scale */
+    ux = (ux & sign) ? (sign << 1) - ux : ux | (sign << 1);
+    uy = (uy & sign) ? (sign << 1) - uy : uy | (sign << 1);
+    return ux > uy ? ux - uy : uy - ux;
+}
+
+/* Whether x and y are within abs_eps, within rel_eps of the larger
+ * magnitude, or within max_ulps (negative limits are not checked). NaN
+ * matches NaN. */
+BETATEST_FUNC int betatest_float_near(double x, double y, int is_double,
+                                      double abs_eps, double rel_eps,
+                                      long long max_ulps) {
+    if (x == y) {
+        return 1;
+    }
+    if (isnan(x) || isnan(y)) {
+        return isnan(x) && isnan(y);
+    }
+    double d = fabs(x - y);
+    if (d <= abs_eps || d <= rel_eps * fmax(fabs(x), fabs(y))) {
+        return 1;
+    }
+    return max_ulps >= 0 &&
+           betatest_ulps(x, y, is_double) <= (unsigned long long)max_ulps;
+}
+
+/* Whether every lane of x and y is within abs_eps or rel_eps */
+static inline int betatest_vf64_near(betatest_vf64 x, betatest_vf64 y,
+                                     double abs_eps, double rel_eps) {
+    const long long mask = 0x7fffffffffffffffLL;
+    betatest_vf64 ad = (betatest_vf64)((betatest_vi64)(x - y) & mask);
+    betatest_vf64 ax = (betatest_vf64)((betatest_vi64)x & mask);
+    betatest_vf64 ay = (betatest_vf64)((betatest_vi64)y & mask);
+    betatest_vi64 ok =
+        (ad <= abs_eps) | (ad <= rel_eps * ax) | (ad <= rel_eps * ay);
+    long long all = -1;
+    for (size_t i = 0; i < sizeof(ok) / sizeof(ok[0]); i++) {
+        all &= ok[i];
+    }
+    return all != 0;
+}
+
+/* Whether a block of floats (size 4) or doubles (size 8) is within abs_eps
+ * or rel_eps everywhere. Floats are widened to doubles first, so a block
+ * passes exactly when betatest_float_near passes each element. A 0 may be
+ * a false alarm (NaNs), so the caller rechecks the block one element at a
+ * time. */
+static inline int betatest_block_near(const char *a, const char *b,
+                                      size_t size, double abs_eps,
+                                      double rel_eps) {
+    betatest_vf64 x;
+    betatest_vf64 y;
+    if (size == 8) {
+        memcpy(&x, a, sizeof(x));
+        memcpy(&y, b, sizeof(y));
+        return betatest_vf64_near(x, y, abs_eps, rel_eps);
+    }
+    const size_t lanes = sizeof(x) / sizeof(x[0]);
+    for (size_t half = 0; half < 2; half++) {
+        float fx[sizeof(x) / sizeof(x[0])];
+        float fy[sizeof(x) / sizeof(x[0])];
+        memcpy(fx, a + half * sizeof(fx), sizeof(fx));
+        memcpy(fy, b + half * sizeof(fy), sizeof(fy));
+        for (size_t i = 0; i < lanes; i++) {
+            x[i] = fx[i];
+            y[i] = fy[i];
+        }
+        if (!betatest_vf64_near(x, y, abs_eps, rel_eps)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+BETATEST_FUNC double betatest_float_at(const void *p, size_t i, size_t size) {
+    if (size == 8) {
+        double d;
+        memcpy(&d, (const char *)p + i * size, sizeof(d));
+        return d;
+    }
+    float f;
+    memcpy(&f, (const char *)p + i * size, sizeof(f));
+    return f;
+}
+
+/* Compare n floats (size 4) or doubles (size 8). Returns the number of
+ * elements that are not near each other, see betatest_float_near. */
+BETATEST_FUNC size_t betatest_floats_diff(const void *a, const void *b,
+                                          size_t n, size_t size,
+                                          double abs_eps, double rel_eps,
+                                          long long max_ulps,
+                                          betatest_diff *diff) {
+    const char *pa = (const char *)a;
+    const char *pb = (const char *)b;
+    diff->first = 0;
+    diff->mismatches = 0;
+    if (n == 0 || pa == pb) {
+        return 0;
+    }
+    if (pa == NULL || pb == NULL) {
+        diff->mismatches = n;
+        return n;
+    }
+    size_t per_block = BETATEST_VECTOR_BYTES / size;
+    size_t blocks_end = n - n % per_block;
+    for (size_t i = 0; i < blocks_end; i += per_block) {
+        const char *ba = pa + i * size;
+        const char *bb = pb + i * size;
+        if (__builtin_expect(betatest_block_equal(ba, bb), 1) ||
+            (max_ulps < 0 &&
+             betatest_block_near(ba, bb, size, abs_eps, rel_eps))) {
+            continue;
+        }
+        for (size_t j = i; j < i + per_block; j++) {
+            if (!betatest_float_near(betatest_float_at(pa, j, size),
+                                     betatest_float_at(pb, j, size),
+                                     size == 8, abs_eps, rel_eps, max_ulps)) {
+                betatest_diff_add(diff, j);
+            }
+        }
+    }
+    for (size_t i = blocks_end; i < n; i++) {
+        if (!betatest_float_near(betatest_float_at(pa, i, size),
+                                 betatest_float_at(pb, i, size), size == 8,
+                                 abs_eps, rel_eps, max_ulps)) {
+            betatest_diff_add(diff, i);
+        }
+    }
+    return diff->mismatches;
+}
+
+/* snprintf onto the end of buf, keeping *len at the string length */
+BETATEST_FUNC __attribute__((format(printf, 4, 5))) void
+betatest_catf(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+    if (*len >= size) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        *len += (size_t)n;
+    }
+    if (*len >= size) {
+        *len = size - 1;
+    }
+}
+
+/* Hexdump the 16 byte row of a and b holding the first difference, with
+ * the differing bytes marked */
+BETATEST_FUNC const char *betatest_format_mem_diff(char *buf, size_t size,
+                                                   const void *a,
+                                                   const void *b, size_t len,
+                                                   const betatest_diff *diff) {
+    size_t n = 0;
+    buf[0] = '\0';
+    if (a == NULL || b == NULL) {
+        betatest_catf(buf, size, &n, "\n       One buffer is NULL");
+        return buf;
+    }
+    const unsigned char *pa = (const unsigned char *)a;
+    const unsigned char *pb = (const unsigned char *)b;
+    size_t row = diff->first & ~(size_t)15;
+    size_t end = row + 16 < len ? row + 16 : len;
+    betatest_catf(buf, size, &n, "\n       First difference at offset %zu:",
+                  diff->first);
+    for (int which = 0; which < 3; which++) {
+        if (which == 0) {
+            betatest_catf(buf, size, &n, "\n       %08zx  1: ", row);
+        } else if (which == 1) {
+            betatest_catf(buf, size, &n, "\n                 2: ");
+        } else {
+            betatest_catf(buf, size, &n, "\n                    ");
+        }
+        for (size_t i = row; i < end; i++) {
+            const char *gap = i == row + 8 ? "  " : " ";
+            if (which == 2) {
+                betatest_catf(buf, size, &n, "%s%s", gap,
+                              pa[i] != pb[i] ? "^^" : "  ");
+            } else {
+                betatest_catf(buf, size, &n, "%s%02x", gap,
+                              which == 0 ? pa[i] : pb[i]);
+            }
+        }
+    }
+    /* Drop the trailing blanks of the marker line */
+    while (n > 0 && buf[n - 1] == ' ') {
+        buf[--n] = '\0';
+    }
+    return buf;
+}
+
+/* Print element i of an integer array, or its bytes for odd sizes */
+BETATEST_FUNC void betatest_format_int_at(char *buf, size_t size, size_t *len,
+                                          const void *p, size_t i,
+                                          size_t elem, int is_signed) {
+    const char *at = (const char *)p + i * elem;
+    unsigned long long u = 0;
+    long long s = 0;
+    switch (elem) {
+    case 1:
+        u = *(const unsigned char *)at;
+        s = *(const signed char *)at;
+        break;
+    case 2: {
+        unsigned short v;
+        memcpy(&v, at, sizeof(v));
+        u = v;
+        s = (short)v;
+        break;
+    }
+    case 4: {
+        unsigned int v;
+        memcpy(&v, at, sizeof(v));
+        u = v;
+        s = (int)v;
+        break;
+    }
+    case 8:
+        memcpy(&u, at, sizeof(u));
+        s = (long long)u;
+        break;
+    default:
+        for (size_t k = 0; k < elem && k < 16; k++) {
+            betatest_catf(buf, size, len, "%02x",
+                          ((const unsigned char *)at)[k]);
+        }
+        return;
+    }
+    if (is_signed) {
+        betatest_catf(buf, size, len, "%lld", s);
+    } else {
+        betatest_catf(buf, size, len, "%llu", u);
+    }
+}
+
+/* List the elements of a and b around the first difference. Integer arrays
+ * pass is_float 0, float and double arrays 1. */
+BETATEST_FUNC const char *
+betatest_format_array_diff(char *buf, size_t size, const void *a,
+                           const void *b, size_t count, size_t elem,
+                           int is_float, int is_signed,
+                           const betatest_diff *diff) {
+    size_t n = 0;
+    buf[0] = '\0';
+    if (a == NULL || b == NULL) {
+        betatest_catf(buf, size, &n, "\n       One array is NULL");
+        return buf;
+    }
+    size_t from = diff->first > 2 ? diff->first - 2 : 0;
+    size_t to = diff->first + 3 < count ? diff->first + 3 : count;
+    betatest_catf(buf, size, &n, "\n       First difference at index %zu:",
+                  diff->first);
+    for (size_t i = from; i < to; i++) {
+        betatest_catf(buf, size, &n, "\n       %s [%zu]  1: ",
+                      i == diff->first ? ">" : " ", i);
+        if (is_float) {
+            betatest_catf(buf, size, &n, "%.10g  2: %.10g",
+                          betatest_float_at(a, i, elem),
+                          betatest_float_at(b, i, elem));
+        } else {
+            betatest_format_int_at(buf, size, &n, a, i, elem, is_signed);
+            betatest_catf(buf, size, &n, "  2: ");
+            betatest_format_int_at(buf, size, &n, b, i, elem, is_signed);
+        }
+    }
+    return buf;
+}
+
+BETATEST_COLD void betatest_fail_mem(const char *file, int line,
+                                     const char *expr_a, const char *expr_b,
+                                     const void *a, const void *b, size_t len,
+                                     const betatest_diff *diff) {
+    char context[1024];
+    betatest_fail(file, line,
+                  "Assertion failed: memory not equal, %zu of %zu bytes "
+                  "differ\n"
+                  "       1:  %s\n"
+                  "       2:  %s%s",
+                  diff->mismatches, len, expr_a, expr_b,
+                  betatest_format_mem_diff(context, sizeof(context), a, b, len,
+                                           diff));
+}
+
+BETATEST_COLD void betatest_fail_ints(const char *file, int line,
+                                      const char *expr_a, const char *expr_b,
+                                      const void *a, const void *b, size_t n,
+                                      size_t elem, int is_signed,
+                                      const betatest_diff *diff) {
+    char context[1024];
+    betatest_fail(file, line,
+                  "Assertion failed: arrays not equal, %zu of %zu elements "
+                  "differ\n"
+                  "       1:  %s\n"
+                  "       2:  %s%s",
+                  diff->mismatches, n, expr_a, expr_b,
+                  betatest_format_array_diff(context, sizeof(context), a, b, n,
+                                             elem, 0, is_signed, diff));
+}
+
+BETATEST_COLD void betatest_fail_floats(const char *file, int line,
+                                        const char *expr_a, const char *expr_b,
+                                        const void *a, const void *b, size_t n,
+                                        size_t elem, double abs_eps,
+                                        double rel_eps, long long max_ulps,
+                                        const betatest_diff *diff) {
+    char context[1024];
+    char within[96];
+    if (max_ulps >= 0) {
+        snprintf(within, sizeof(within), "%lld ulps", max_ulps);
+    } else {
+        snprintf(within, sizeof(within), "abs %g or rel %g", abs_eps,
+                 rel_eps);
+    }
+    betatest_fail(file, line,
+                  "Assertion failed: arrays not equal within %s, %zu of %zu "
+                  "elements differ\n"
+                  "       1:  %s\n"
+                  "       2:  %s%s",
+                  within, diff->mismatches, n, expr_a, expr_b,
+                  betatest_format_array_diff(context, sizeof(context), a, b, n,
+                                             elem, 1, 1, diff));
+}
+
+/* Buffer and array assertions */
+#define ASSERT_MEM_EQ(a, b, len)                                               \
+    do {                                                                       \
+        const void *_a = (a);                                                  \
+        const void *_b = (b);                                                  \
+        size_t _len = (size_t)(len);                                           \
+        betatest_diff _diff;                                                   \
+        BETATEST_CHECK(betatest_bytes_diff(_a, _b, _len, 1, &_diff) == 0,      \
+                       betatest_fail_mem(__FILE__, __LINE__, #a, #b, _a, _b,   \
+                                         _len, &_diff));                       \
+    } while (0)
+
+/* Element-wise equality of two integer arrays of n elements */
+#define ASSERT_ARRAY_INT_EQ(a, b, n)                                           \
+    do {                                                                       \
+        const void *_a = (a);                                                  \
+        const void *_b = (b);                                                  \
+        size_t _n = (size_t)(n);                                               \
+        betatest_diff _diff;                                                   \
+        if (sizeof(*(a)) != sizeof(*(b))) {                                    \
+            BETATEST_RECORD_FAIL("Assertion failed: element sizes differ\n"    \
+                                 "       1:  %s has %zu byte elements\n"       \
+                                 "       2:  %s has %zu byte elements",        \
+                                 #a, sizeof(*(a)), #b, sizeof(*(b)));          \
+            break;                                                             \
         }                                                                      \
+        BETATEST_CHECK(                                                        \
+            betatest_bytes_diff(_a, _b, _n, sizeof(*(a)), &_diff) == 0,        \
+            betatest_fail_ints(__FILE__, __LINE__, #a, #b, _a, _b, _n,         \
+                               sizeof(*(a)), BETATEST_IS_SIGNED(*(a)),         \
+                               &_diff));                                       \
     } while (0)
 
-/* Comparison operators */
-#define ASSERT_LT(a, b)                                                        \
+#define BETATEST_ARRAY_FLOAT_CHECK(a, b, n, abs_eps, rel_eps, ulps)            \
     do {                                                                       \
-        if ((a) < (b)) {                                                       \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: expected %s < %s", #a,     \
-                                 #b);                                          \
+        const void *_a = (a);                                                  \
+        const void *_b = (b);                                                  \
+        size_t _n = (size_t)(n);                                               \
+        double _abs_eps = (double)(abs_eps);                                   \
+        double _rel_eps = (double)(rel_eps);                                   \
+        long long _ulps = (long long)(ulps);                                   \
+        betatest_diff _diff;                                                   \
+        if (sizeof(*(a)) != sizeof(*(b)) ||                                    \
+            (sizeof(*(a)) != 4 && sizeof(*(a)) != 8)) {                        \
+            BETATEST_RECORD_FAIL("Assertion failed: expected two float or "    \
+                                 "two double arrays\n"                         \
+                                 "       1:  %s\n"                             \
+                                 "       2:  %s",                              \
+                                 #a, #b);                                      \
+            break;                                                             \
         }                                                                      \
+        BETATEST_CHECK(betatest_floats_diff(_a, _b, _n, sizeof(*(a)),          \
+                                            _abs_eps, _rel_eps, _ulps,         \
+                                            &_diff) == 0,                      \
+                       betatest_fail_floats(__FILE__, __LINE__, #a, #b, _a,    \
+                                            _b, _n, sizeof(*(a)), _abs_eps,    \
+                                            _rel_eps, _ulps, &_diff));         \
+    } while (0)
+
+/* Element-wise closeness of two float or double arrays: each pair must be
+ * within abs_eps, or within rel_eps times the larger magnitude */
+#define ASSERT_ARRAY_FLOAT_NEAR(a, b, n, abs_eps, rel_eps)                     \
+    BETATEST_ARRAY_FLOAT_CHECK(a, b, n, abs_eps, rel_eps, -1)
+
+/* The same, allowing each pair to be at most `ulps` representable values
+ * apart */
+#define ASSERT_ARRAY_FLOAT_ULPS(a, b, n, ulps)                                 \
+    BETATEST_ARRAY_FLOAT_CHECK(a, b, n, -1.0, -1.0, ulps)
+
+/* Golden files
+ *
+ * ASSERT_MATCHES_GOLDEN compares a buffer with a memory-mapped reference
+ * file using the vectorised betatest_bytes_diff. There is no hash check
+ * first: hashing reads every byte too, and costs more per byte than the
+ * compare. With --update-golden (or BETATEST_UPDATE_GOLDEN=1) a file that
+ * differs is rewritten instead, through a temporary file renamed over it. */
+typedef struct {
+    const char *path;
+    const unsigned char *data; /* the output */
+    size_t len;
+    const unsigned char *map; /* the golden file */
+    size_t map_len;
+    int error;   /* errno of reading or updating the file, or 0 */
+    int updated; /* rewritten by --update-golden */
+    betatest_diff diff;
+} betatest_golden;
+
+BETATEST_FUNC int betatest_golden_update_wanted(void) {
+    const char *env = getenv("BETATEST_UPDATE_GOLDEN");
+    return betatest_options.update_golden || (env && atoi(env) != 0);
+}
+
+BETATEST_FUNC int betatest_golden_map(betatest_golden *g) {
+    int fd = open(g->path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        g->error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    g->map_len = (size_t)st.st_size;
+    if (g->map_len > 0) {
+        void *map = mmap(NULL, g->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        g->error = map == MAP_FAILED ? errno : 0;
+        g->map = map == MAP_FAILED ? NULL : (const unsigned char *)map;
+    }
+    close(fd);
+    return g->error ? -1 : 0;
+}
+
+/* Replace the golden file with the output, atomically */
+BETATEST_FUNC int betatest_golden_write(betatest_golden *g) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", g->path, (long)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        g->error = errno;
+        return -1;
+    }
+    int failed = betatest_write_full(fd, g->data, g->len) != 0;
+    if (failed) {
+        g->error = errno;
+    }
+    if (close(fd) != 0 && !failed) {
+        g->error = errno;
+        failed = 1;
+    }
+    if (!failed && rename(tmp, g->path) != 0) {
+        g->error = errno;
+        failed = 1;
+    }
+    if (failed) {
+        unlink(tmp);
+        return -1;
+    }
+    g->updated = 1;
+    return 0;
+}
+
+/* Compare `data` with the golden file at `path`, or update it. Returns
+ * 1 on a match or a successful update. */
+BETATEST_FUNC int betatest_golden_check(betatest_golden *g, const void *data,
+                                        size_t len, const char *path) {
+    memset(g, 0, sizeof(*g));
+    g->path = path;
+    g->data = (const unsigned char *)data;
+    g->len = data ? len : 0;
+    int mapped = betatest_golden_map(g) == 0;
+    int same = mapped && g->map_len == g->len &&
+               betatest_bytes_diff(g->map, g->data, g->len, 1, &g->diff) == 0;
+    if (same || !betatest_golden_update_wanted()) {
+        if (mapped && !same) {
+            size_t common = g->len < g->map_len ? g->len : g->map_len;
+            betatest_bytes_diff(g->map, g->data, common, 1, &g->diff);
+        }
+        return same;
+    }
+    g->error = 0;
+    if (betatest_golden_write(g) != 0) {
+        return 0;
+    }
+    BETATEST_PRINT_INFO();
+    betatest_printf("Updated golden file %s (%zu bytes)\n", path, g->len);
+    return 1;
+}
+
+BETATEST_FUNC void betatest_golden_close(betatest_golden *g) {
+    if (g->map != NULL) {
+        munmap((void *)g->map, g->map_len);
+    }
+}
+
+/* Append the line around offset `at` of a text buffer, at most 40 bytes
+ * either side, as a quoted string */
+BETATEST_FUNC void betatest_catf_excerpt(char *buf, size_t size, size_t *n,
+                                         const unsigned char *p, size_t len,
+                                         size_t at) {
+    size_t from = at;
+    while (from > 0 && p[from - 1] != '\n' && at - from < 40) {
+        from--;
+    }
+    size_t to = at;
+    while (to < len && p[to] != '\n' && to - at < 40) {
+        to++;
+    }
+    betatest_catf(buf, size, n, "%s\"", from > 0 && p[from - 1] != '\n'
+                                           ? "..."
+                                           : "");
+    for (size_t i = from; i < to; i++) {
+        unsigned char c = p[i];
+        if (c == '"' || c == '\\') {
+            betatest_catf(buf, size, n, "\\%c", c);
+        } else if (c == '\t') {
+            betatest_catf(buf, size, n, "\\t");
+        } else if (c == '\r') {
+            betatest_catf(buf, size, n, "\\r");
+        } else {
+            betatest_catf(buf, size, n, "%c", c);
+        }
+    }
+    betatest_catf(buf, size, n, "\"%s", to < len && p[to] != '\n' ? "..." : "");
+}
+
+/* Whether the bytes of both buffers around offset `at` look like text */
+BETATEST_FUNC int betatest_golden_is_text(const betatest_golden *g,
+                                          size_t at) {
+    for (int which = 0; which < 2; which++) {
+        const unsigned char *p = which ? g->data : g->map;
+        size_t len = which ? g->len : g->map_len;
+        size_t from = at > 64 ? at - 64 : 0;
+        for (size_t i = from; i < len && i < at + 64; i++) {
+            if (p[i] < 0x20 && p[i] != '\n' && p[i] != '\t' &&
+                p[i] != '\r') {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+BETATEST_COLD void betatest_fail_golden(const char *file, int line,
+                                        const char *expr,
+                                        const betatest_golden *g) {
+    if (g->error != 0) {
+        betatest_fail(file, line,
+                      "Assertion failed: cannot %s golden file %s: %s%s",
+                      betatest_golden_update_wanted() ? "update" : "read",
+                      g->path, strerror(g->error),
+                      g->error == ENOENT && !betatest_golden_update_wanted()
+                          ? "\n       Run with --update-golden to create it"
+                          : "");
+        return;
+    }
+    char context[1024];
+    size_t n = 0;
+    context[0] = '\0';
+    size_t common = g->len < g->map_len ? g->len : g->map_len;
+    if (g->diff.mismatches == 0) {
+        betatest_catf(context, sizeof(context), &n,
+                      "\n       The first %zu bytes match, the output is %zu "
+                      "bytes %s",
+                      common,
+                      g->len > g->map_len ? g->len - g->map_len
+                                          : g->map_len - g->len,
+                      g->len > g->map_len ? "longer" : "shorter");
+    } else if (betatest_golden_is_text(g, g->diff.first)) {
+        size_t at = g->diff.first;
+        size_t lineno = 1;
+        size_t column = 1;
+        for (size_t i = 0; i < at; i++) {
+            column = g->data[i] == '\n' ? 1 : column + 1;
+            lineno += g->data[i] == '\n';
+        }
+        betatest_catf(context, sizeof(context), &n,
+                      "\n       %zu of %zu bytes differ, first at offset %zu "
+                      "(line %zu, column %zu):\n       golden: ",
+                      g->diff.mismatches, common, at, lineno, column);
+        betatest_catf_excerpt(context, sizeof(context), &n, g->map,
+                              g->map_len, at);
+        betatest_catf(context, sizeof(context), &n, "\n       output: ");
+        betatest_catf_excerpt(context, sizeof(context), &n, g->data, g->len,
+                              at);
+    } else {
+        char dump[512];
+        betatest_catf(context, sizeof(context), &n,
+                      "\n       %zu of %zu bytes differ (1: golden, 2: "
+                      "output)%s",
+                      g->diff.mismatches, common,
+                      betatest_format_mem_diff(dump, sizeof(dump), g->map,
+                                               g->data, common, &g->diff));
+    }
+    betatest_fail(file, line,
+                  "Assertion failed: %s differs from golden file %s\n"
+                  "       Output: %zu bytes\n"
+                  "       Golden: %zu bytes%s",
+                  expr, g->path, g->len, g->map_len, context);
+}
+
+/* Assert that `len` bytes at `buf` equal the contents of the file `path` */
+#define ASSERT_MATCHES_GOLDEN(buf, len, path)                                  \
+    do {                                                                       \
+        betatest_golden _golden;                                               \
+        int _ok = betatest_golden_check(&_golden, (buf), (size_t)(len),        \
+                                        (path));                               \
+        BETATEST_CHECK(_ok, betatest_fail_golden(__FILE__, __LINE__, #buf,     \
+                                                 &_golden));                   \
+        betatest_golden_close(&_golden);                                       \
     } while (0)
 
+/* Comparison operators */
+#define ASSERT_LT(a, b)                                                        \
+    BETATEST_CHECK((a) < (b), betatest_fail_msg(__FILE__, __LINE__,            \
+                                                "expected " #a " < " #b))
+
 #define ASSERT_LE(a, b)                                                        \
+    BETATEST_CHECK((a) <= (b), betatest_fail_msg(__FILE__, __LINE__,           \
+                                                "expected " #a " <= " #b))
+
+#define ASSERT_GT(a, b)                                                        \
+    BETATEST_CHECK((a) > (b), betatest_fail_msg(__FILE__, __LINE__,            \
+                                                "expected " #a " > " #b))
+
+#define ASSERT_GE(a, b)                                                        \
+    BETATEST_CHECK((a) >= (b), betatest_fail_msg(__FILE__, __LINE__,           \
+                                                "expected " #a " >= " #b))
+
+/* Custom assertion with message */
+#define ASSERT_MSG(cond, msg, ...)                                             \
+    BETATEST_CHECK(cond, BETATEST_RECORD_FAIL("Assertion failed: " msg,        \
+                                              ##__VA_ARGS__))
+
+/* Allocation assertions (need BETATEST_TRACK_ALLOCS). They count the
+ * allocations made by any thread while the block runs. */
+BETATEST_COLD void betatest_fail_allocs(const char *file, int line,
+                                        long allocs, long max) {
+    if (!BETATEST_ALLOCS_TRACKED) {
+        betatest_fail(file, line,
+                      "Assertion failed: allocation tracking is off, define "
+                      "BETATEST_TRACK_ALLOCS");
+    } else {
+        betatest_fail(file, line,
+                      "Assertion failed: block made %ld allocations, "
+                      "expected at most %ld",
+                      allocs, max);
+    }
+}
+
+#define BETATEST_CHECK_ALLOCS(before, max)                                     \
+    do {                                                                       \
+        long _allocs = betatest_alloc_count() - (before);                      \
+        long _max = (long)(max);                                               \
+        BETATEST_CHECK(BETATEST_ALLOCS_TRACKED && _allocs <= _max,             \
+                       betatest_fail_allocs(__FILE__, __LINE__, _allocs,       \
+                                            _max));                            \
+    } while (0)
+
+#define ASSERT_MAX_ALLOCS(block, n)                                            \
+    do {                                                                       \
+        long _allocs_before = betatest_alloc_count();                          \
+        block;                                                                 \
+        BETATEST_CHECK_ALLOCS(_allocs_before, n);                              \
+    } while (0)
+
+/* The block may contain commas: ASSERT_NO_ALLOCS({ int a = 1, b = 2; }) */
+#define ASSERT_NO_ALLOCS(...)                                                  \
+    do {                                                                       \
+        long _allocs_before = betatest_alloc_count();                          \
+        __VA_ARGS__;                                                           \
+        BETATEST_CHECK_ALLOCS(_allocs_before, 0);                              \
+    } while (0)
+
+BETATEST_COLD void betatest_perf_skipped(int counter, const char *file,
+                                         int line) {
+    BETATEST_PRINT_INFO();
+    betatest_printf("%s unavailable, skipped assertion at %s:%d\n",
+                    betatest_perf_name(counter), file, line);
+}
+
+BETATEST_COLD void betatest_fail_perf(const char *file, int line,
+                                      int counter, double per_op,
+                                      double max) {
+    betatest_fail(file, line,
+                  "Assertion failed: %.3f %s per operation, expected at "
+                  "most %.3f",
+                  per_op, betatest_perf_name(counter), max);
+}
+
+/* Performance counter assertions: `counter` is one of the BETATEST_PERF_*
+ * constants, and the block (which may contain commas) does `ops`
+ * operations. Skipped, with a note, where the counter is unavailable. */
+#define ASSERT_PERF_PER_OP_LE(counter, ops, max, ...)                          \
     do {                                                                       \
-        if ((a) <= (b)) {                                                      \
-            BETATEST_RECORD_PASS();                                            \
+        betatest_perf_mark _perf_mark;                                         \
+        betatest_perf_values _perf;                                            \
+        int _perf_open = betatest_perf_open() > 0;                             \
+        if (_perf_open) {                                                      \
+            betatest_perf_begin(&_perf_mark);                                  \
+        }                                                                      \
+        __VA_ARGS__;                                                           \
+        double _per_op = NAN;                                                  \
+        if (_perf_open) {                                                      \
+            betatest_perf_end(&_perf_mark, &_perf);                            \
+            _per_op = _perf.values[counter] / (double)(ops);                   \
+        }                                                                      \
+        if (isnan(_per_op)) {                                                  \
+            betatest_perf_skipped(counter, __FILE__, __LINE__);                \
         } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: expected %s <= %s", #a,    \
-                                 #b);                                          \
+            double _max = (double)(max);                                       \
+            BETATEST_CHECK(_per_op <= _max,                                    \
+                           betatest_fail_perf(__FILE__, __LINE__, counter,     \
+                                              _per_op, _max));                 \
         }                                                                      \
     } while (0)
 
-#define ASSERT_GT(a, b)                                                        \
+#define ASSERT_PERF_LE(counter, max, ...)                                      \
+    ASSERT_PERF_PER_OP_LE(counter, 1, max, __VA_ARGS__)
+
+/* Latency histograms
+ *
+ * A log-linear (HDR style) histogram of non-negative values, e.g. ns.
+ * Values below 2^BETATEST_HISTOGRAM_BITS are counted exactly; above that
+ * each power of two is split into 2^(BETATEST_HISTOGRAM_BITS - 1) buckets,
+ * so a recorded value is off by less than 1 / 2^(BETATEST_HISTOGRAM_BITS -
+ * 1) of itself. The size is fixed, recording is O(1) and percentiles are
+ * reported as the highest value of their bucket. */
+#ifndef BETATEST_HISTOGRAM_BITS
+#define BETATEST_HISTOGRAM_BITS 7
+#endif
+
+#define BETATEST_HISTOGRAM_SUB (1 << BETATEST_HISTOGRAM_BITS)
+#define BETATEST_HISTOGRAM_BUCKETS                                             \
+    (BETATEST_HISTOGRAM_SUB +                                                  \
+     (64 - BETATEST_HISTOGRAM_BITS) * (BETATEST_HISTOGRAM_SUB / 2))
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long min;
+    unsigned long long max;
+    double sum;
+    unsigned long long buckets[BETATEST_HISTOGRAM_BUCKETS];
+} betatest_histogram;
+
+BETATEST_FUNC void betatest_histogram_init(betatest_histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = ~0ULL;
+}
+
+/* A cleared histogram on the heap, not counted as a test allocation */
+BETATEST_FUNC betatest_histogram *betatest_histogram_new(void) {
+    betatest_untracked++;
+    betatest_histogram *h = (betatest_histogram *)malloc(sizeof(*h));
+    betatest_untracked--;
+    if (h != NULL) {
+        betatest_histogram_init(h);
+    }
+    return h;
+}
+
+BETATEST_FUNC void betatest_histogram_free(betatest_histogram *h) {
+    betatest_untracked++;
+    free(h);
+    betatest_untracked--;
+}
+
+static inline int betatest_histogram_index(unsigned long long value) {
+    if (value < BETATEST_HISTOGRAM_SUB) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (BETATEST_HISTOGRAM_BITS - 1);
+    return BETATEST_HISTOGRAM_SUB + (shift - 1) * (BETATEST_HISTOGRAM_SUB / 2) +
+           (int)(value >> shift) - BETATEST_HISTOGRAM_SUB / 2;
+}
+
+/* Highest value that lands in bucket `index` */
+BETATEST_FUNC unsigned long long betatest_histogram_top(int index) {
+    if (index < BETATEST_HISTOGRAM_SUB) {
+        return (unsigned long long)index;
+    }
+    int k = index - BETATEST_HISTOGRAM_SUB;
+    int shift = k / (BETATEST_HISTOGRAM_SUB / 2) + 1;
+    unsigned long long top =
+        (unsigned long long)(k % (BETATEST_HISTOGRAM_SUB / 2) +
+                             BETATEST_HISTOGRAM_SUB / 2);
+    return ((top + 1) << shift) - 1;
+}
+
+static inline void betatest_histogram_record(betatest_histogram *h,
+                                             long long value) {
+    unsigned long long v = value > 0 ? (unsigned long long)value : 0;
+    h->buckets[betatest_histogram_index(v)]++;
+    h->count++;
+    h->sum += (double)v;
+    h->min = v < h->min ? v : h->min;
+    h->max = v > h->max ? v : h->max;
+}
+
+/* Value at or below which `pct` percent of the recorded values fall */
+BETATEST_FUNC unsigned long long
+betatest_histogram_percentile(const betatest_histogram *h, double pct) {
+    if (h->count == 0) {
+        return 0;
+    }
+    double rank = ceil(pct / 100.0 * (double)h->count);
+    unsigned long long want = rank < 1.0 ? 1 : (unsigned long long)rank;
+    unsigned long long seen = 0;
+    for (int i = 0; i < BETATEST_HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            unsigned long long top = betatest_histogram_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* "12 ns", "3.40 us", "1.25 ms" or "2.00 s" */
+BETATEST_FUNC const char *betatest_format_ns(char *buf, size_t size,
+                                             double ns) {
+    if (ns < 1e3) {
+        snprintf(buf, size, "%.0f ns", ns);
+    } else if (ns < 1e6) {
+        snprintf(buf, size, "%.2f us", ns / 1e3);
+    } else if (ns < 1e9) {
+        snprintf(buf, size, "%.2f ms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2f s", ns / 1e9);
+    }
+    return buf;
+}
+
+/* Append the count, min, mean, max and the usual percentiles of `h` */
+BETATEST_FUNC void betatest_histogram_format(const betatest_histogram *h,
+                                             char *buf, size_t size,
+                                             size_t *len) {
+    static const double pcts[] = {50.0, 90.0, 99.0, 99.9, 99.99};
+    char a[32];
+    char b[32];
+    char c[32];
+    betatest_catf(buf, size, len, "%llu samples: min %s, mean %s, max %s",
+                  h->count, betatest_format_ns(a, sizeof(a), (double)h->min),
+                  betatest_format_ns(b, sizeof(b),
+                                     h->count ? h->sum / h->count : 0.0),
+                  betatest_format_ns(c, sizeof(c), (double)h->max));
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+        betatest_catf(buf, size, len, "\n       p%-6g %s", pcts[i],
+                      betatest_format_ns(
+                          a, sizeof(a),
+                          (double)betatest_histogram_percentile(h, pcts[i])));
+    }
+}
+
+BETATEST_COLD void betatest_fail_latency(const char *file, int line,
+                                         const char *expr, double pct,
+                                         double limit_ns,
+                                         const betatest_histogram *h) {
+    char breakdown[1024];
+    size_t len = 0;
+    char value[32];
+    char limit[32];
+    breakdown[0] = '\0';
+    betatest_histogram_format(h, breakdown, sizeof(breakdown), &len);
+    betatest_fail(file, line,
+                  "Assertion failed: p%g latency of %s is %s, expected below "
+                  "%s\n"
+                  "       %s",
+                  pct, expr,
+                  betatest_format_ns(value, sizeof(value),
+                                     (double)betatest_histogram_percentile(
+                                         h, pct)),
+                  betatest_format_ns(limit, sizeof(limit), limit_ns),
+                  breakdown);
+}
+
+/* Time `expr` `samples` times with CLOCK_MONOTONIC and assert that its
+ * `pct` percentile latency is below `ns` nanoseconds. `expr` must have a
+ * value, which is kept live so the work cannot be optimised away. A failure
+ * prints the whole percentile breakdown. */
+#define ASSERT_LATENCY_BELOW(expr, samples, pct, ns)                           \
     do {                                                                       \
-        if ((a) > (b)) {                                                       \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: expected %s > %s", #a,     \
-                                 #b);                                          \
+        betatest_histogram *_hist = betatest_histogram_new();                  \
+        long long _samples = (long long)(samples);                             \
+        double _pct = (double)(pct);                                           \
+        double _limit = (double)(ns);                                          \
+        if (_hist == NULL) {                                                   \
+            betatest_fail_msg(__FILE__, __LINE__,                              \
+                              "cannot allocate a latency histogram");          \
+            break;                                                             \
+        }                                                                      \
+        for (long long _i = 0; _i < _samples; _i++) {                          \
+            long long _start = betatest_clock_ns(CLOCK_MONOTONIC);             \
+            BETATEST_DO_NOT_OPTIMIZE(expr);                                    \
+            betatest_histogram_record(                                         \
+                _hist, betatest_clock_ns(CLOCK_MONOTONIC) - _start);           \
         }                                                                      \
+        BETATEST_CHECK((double)betatest_histogram_percentile(_hist, _pct) <    \
+                           _limit,                                             \
+                       betatest_fail_latency(__FILE__, __LINE__, #expr, _pct,  \
+                                             _limit, _hist));                  \
+        betatest_histogram_free(_hist);                                        \
     } while (0)
 
-#define ASSERT_GE(a, b)                                                        \
+#define ASSERT_LATENCY_P50_BELOW(expr, samples, ns)                            \
+    ASSERT_LATENCY_BELOW(expr, samples, 50, ns)
+
+#define ASSERT_LATENCY_P99_BELOW(expr, samples, ns)                            \
+    ASSERT_LATENCY_BELOW(expr, samples, 99, ns)
+
+/* Polling assertions
+ *
+ * ASSERT_EVENTUALLY and friends re-check a condition until it holds or the
+ * timeout passes, sleeping BETATEST_EVENTUALLY_MIN_US at first and twice as
+ * long after each check, up to BETATEST_EVENTUALLY_MAX_US. The last sleep is
+ * cut short at the deadline so the condition is always checked there. */
+typedef struct {
+    long long start_ns;
+    long long deadline_ns;
+    long long sleep_ns;
+    long polls;
+    int timeout_ms;
+} betatest_poll;
+
+BETATEST_FUNC betatest_poll betatest_poll_begin(int timeout_ms) {
+    betatest_poll p;
+    p.start_ns = betatest_clock_ns(CLOCK_MONOTONIC);
+    p.deadline_ns = p.start_ns + (long long)timeout_ms * 1000000;
+    p.sleep_ns = (long long)BETATEST_EVENTUALLY_MIN_US * 1000;
+    p.polls = 0;
+    p.timeout_ms = timeout_ms;
+    return p;
+}
+
+/* After a failed check: returns 0 once the deadline has passed, otherwise
+ * sleeps until the next check and returns 1 */
+BETATEST_FUNC int betatest_poll_wait(betatest_poll *p) {
+    long long left = p->deadline_ns - betatest_clock_ns(CLOCK_MONOTONIC);
+    if (left <= 0) {
+        return 0;
+    }
+    long long ns = p->sleep_ns < left ? p->sleep_ns : left;
+    struct timespec ts = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+    p->sleep_ns *= 2;
+    if (p->sleep_ns > (long long)BETATEST_EVENTUALLY_MAX_US * 1000) {
+        p->sleep_ns = (long long)BETATEST_EVENTUALLY_MAX_US * 1000;
+    }
+    return 1;
+}
+
+BETATEST_FUNC double betatest_poll_elapsed_ms(const betatest_poll *p) {
+    return (double)(betatest_clock_ns(CLOCK_MONOTONIC) - p->start_ns) / 1e6;
+}
+
+/* With BETATEST_PRINT_ON_PASS, say how long a passing wait took */
+BETATEST_FUNC void betatest_poll_passed(const betatest_poll *p,
+                                        const char *what) {
+    if (BETATEST_DO_PRINT_PASS) {
+        BETATEST_PRINT_INFO();
+        betatest_printf("%s after %.3f ms, %ld poll%s\n", what,
+                        betatest_poll_elapsed_ms(p), p->polls,
+                        p->polls == 1 ? "" : "s");
+    }
+}
+
+BETATEST_COLD void betatest_fail_eventually(const char *file, int line,
+                                            const char *expr,
+                                            const betatest_poll *p) {
+    betatest_fail(file, line,
+                  "Assertion failed: condition never held\n"
+                  "       Expression: %s\n"
+                  "       Waited %.3f ms (timeout %d ms), %ld polls",
+                  expr, betatest_poll_elapsed_ms(p), p->timeout_ms, p->polls);
+}
+
+BETATEST_COLD void betatest_fail_eventually_int(const char *file, int line,
+                                                const char *expr_a,
+                                                long long a,
+                                                const char *expr_b,
+                                                long long b,
+                                                const betatest_poll *p) {
+    char what[128];
+    snprintf(what, sizeof(what),
+             "integers still not equal after %.3f ms (timeout %d ms), %ld "
+             "polls",
+             betatest_poll_elapsed_ms(p), p->timeout_ms, p->polls);
+    betatest_fail_int(file, line, what, expr_a, a, expr_b, b);
+}
+
+/* Wait with poll(2) until `fd` reports one of `events` (POLLHUP counts
+ * for POLLIN: a read would not block). Returns 1 when ready, 0 on timeout
+ * and -1 on an error; *revents holds what poll reported last. */
+BETATEST_FUNC int betatest_poll_fd(betatest_poll *p, int fd, short events,
+                                   short *revents) {
+    short want = events & POLLIN ? (short)(events | POLLHUP) : events;
+    *revents = 0;
+    for (;;) {
+        long long left = p->deadline_ns - betatest_clock_ns(CLOCK_MONOTONIC);
+        int ms = left > 0 ? (int)((left + 999999) / 1000000) : 0;
+        struct pollfd pfd = {fd, events, 0};
+        p->polls++;
+        int n = poll(&pfd, 1, ms);
+        if (n > 0) {
+            *revents = pfd.revents;
+            return pfd.revents & want ? 1 : -1;
+        }
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (n == 0 && ms == 0) {
+            return 0;
+        }
+    }
+}
+
+BETATEST_COLD void betatest_fail_fd(const char *file, int line,
+                                    const char *expr, short events, int ready,
+                                    short revents, const betatest_poll *p) {
+    if (ready == 0) {
+        betatest_fail(file, line,
+                      "Assertion failed: fd %s not ready for events 0x%x\n"
+                      "       Waited %.3f ms (timeout %d ms)",
+                      expr, (unsigned)events, betatest_poll_elapsed_ms(p),
+                      p->timeout_ms);
+    } else {
+        betatest_fail(file, line,
+                      "Assertion failed: poll on fd %s failed\n"
+                      "       Events 0x%x, revents 0x%x%s, after %.3f ms",
+                      expr, (unsigned)events, (unsigned)revents,
+                      revents & POLLNVAL ? " (not an open fd)"
+                      : revents & POLLERR ? " (error condition)"
+                      : revents == 0      ? " (poll failed)"
+                                          : "",
+                      betatest_poll_elapsed_ms(p));
+    }
+}
+
+/* Pass as soon as `cond` holds; fail if it still does not after
+ * `timeout_ms` milliseconds */
+#define ASSERT_EVENTUALLY(cond, timeout_ms)                                    \
     do {                                                                       \
-        if ((a) >= (b)) {                                                      \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: expected %s >= %s", #a,    \
-                                 #b);                                          \
+        betatest_poll _poll = betatest_poll_begin(timeout_ms);                 \
+        int _ok;                                                               \
+        for (;;) {                                                             \
+            _poll.polls++;                                                     \
+            _ok = (cond) ? 1 : 0;                                              \
+            if (_ok || !betatest_poll_wait(&_poll)) {                          \
+                break;                                                         \
+            }                                                                  \
+        }                                                                      \
+        BETATEST_CHECK(_ok, betatest_fail_eventually(__FILE__, __LINE__,       \
+                                                     #cond, &_poll));          \
+        if (_ok) {                                                             \
+            betatest_poll_passed(&_poll, #cond " held");                       \
         }                                                                      \
     } while (0)
 
-/* Custom assertion with message */
-#define ASSERT_MSG(cond, msg, ...)                                             \
+/* ASSERT_EVENTUALLY for two integer expressions, reporting both values */
+#define ASSERT_EVENTUALLY_INT_EQ(a, b, timeout_ms)                             \
     do {                                                                       \
-        if (cond) {                                                            \
-            BETATEST_RECORD_PASS();                                            \
-        } else {                                                               \
-            BETATEST_RECORD_FAIL("Assertion failed: " msg, ##__VA_ARGS__);     \
+        betatest_poll _poll = betatest_poll_begin(timeout_ms);                 \
+        long long _a;                                                          \
+        long long _b;                                                          \
+        for (;;) {                                                             \
+            _poll.polls++;                                                     \
+            _a = (long long)(a);                                               \
+            _b = (long long)(b);                                               \
+            if (_a == _b || !betatest_poll_wait(&_poll)) {                     \
+                break;                                                         \
+            }                                                                  \
+        }                                                                      \
+        BETATEST_CHECK(_a == _b,                                               \
+                       betatest_fail_eventually_int(__FILE__, __LINE__, #a,    \
+                                                    _a, #b, _b, &_poll));      \
+        if (_a == _b) {                                                        \
+            betatest_poll_passed(&_poll, #a " == " #b);                        \
         }                                                                      \
     } while (0)
 
-/* Summary and reset */
-#define TEST_SUMMARY()                                                         \
+/* Wait with poll(2) until `fd` is ready for `events` (POLLIN, POLLOUT...) */
+#define ASSERT_EVENTUALLY_FD(fd, events, timeout_ms)                           \
     do {                                                                       \
-        printf("%s%s", BETATEST_COLOR_BOLD, BETATEST_COLOR_CYAN);              \
-        printf("========================================\n");                  \
-        printf("           TEST SUMMARY\n");                                   \
-        printf("========================================%s\n",                 \
-               BETATEST_COLOR_RESET);                                          \
-        printf("Tests:      %d run, ", betatest_stats.tests_run);              \
-        printf("%s%d passed%s, ", BETATEST_COLOR_GREEN,                        \
-               betatest_stats.tests_passed, BETATEST_COLOR_RESET);             \
-        printf("%s%d failed%s\n", BETATEST_COLOR_RED,                          \
-               betatest_stats.tests_failed, BETATEST_COLOR_RESET);             \
-        printf("Assertions: %d run, ", betatest_stats.assertions_run);         \
-        printf("%s%d passed%s, ", BETATEST_COLOR_GREEN,                        \
-               betatest_stats.assertions_passed, BETATEST_COLOR_RESET);        \
-        printf("%s%d failed%s\n", BETATEST_COLOR_RED,                          \
-               betatest_stats.assertions_failed, BETATEST_COLOR_RESET);        \
-        printf("%s========================================%s\n",               \
-               BETATEST_COLOR_CYAN, BETATEST_COLOR_RESET);                     \
-        if (betatest_stats.tests_failed == 0) {                                \
-            printf("%s%sALL TESTS PASSED!%s\n", BETATEST_COLOR_BOLD,           \
-                   BETATEST_COLOR_GREEN, BETATEST_COLOR_RESET);                \
-        } else {                                                               \
-            printf("%s%sSOME TESTS FAILED%s\n", BETATEST_COLOR_BOLD,           \
-                   BETATEST_COLOR_RED, BETATEST_COLOR_RESET);                  \
+        betatest_poll _poll = betatest_poll_begin(timeout_ms);                 \
+        short _events = (short)(events);                                       \
+        short _revents;                                                        \
+        int _ready = betatest_poll_fd(&_poll, (fd), _events, &_revents);       \
+        BETATEST_CHECK(_ready == 1,                                            \
+                       betatest_fail_fd(__FILE__, __LINE__, #fd, _events,      \
+                                        _ready, _revents, &_poll));            \
+        if (_ready == 1) {                                                     \
+            betatest_poll_passed(&_poll, "fd " #fd " ready");                  \
         }                                                                      \
-        printf("\n");                                                          \
     } while (0)
 
-#define TEST_RESET()                                                           \
+#define ASSERT_EVENTUALLY_READABLE(fd, timeout_ms)                             \
+    ASSERT_EVENTUALLY_FD(fd, POLLIN, timeout_ms)
+
+#define ASSERT_EVENTUALLY_WRITABLE(fd, timeout_ms)                             \
+    ASSERT_EVENTUALLY_FD(fd, POLLOUT, timeout_ms)
+
+/* Death assertions
+ *
+ * ASSERT_DEATH forks and runs only the statement in the child, with the
+ * default signal actions, no core dump and its output sent to /dev/null. The
+ * statement dies if the child is killed by a signal or exits non-zero. */
+BETATEST_FUNC pid_t betatest_death_fork(void) {
+    betatest_flush_output();
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid != 0) {
+        betatest_crash.child = pid;
+        return pid;
+    }
+    betatest_crash_armed = 0;
+    betatest_output.len = 0;
+    for (size_t i = 0; i < sizeof(betatest_crash_signals) /
+                               sizeof(betatest_crash_signals[0]);
+         i++) {
+        signal(betatest_crash_signals[i], SIG_DFL);
+    }
+    struct rlimit core;
+    core.rlim_cur = 0;
+    core.rlim_max = 0;
+    setrlimit(RLIMIT_CORE, &core);
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+    return 0;
+}
+
+/* Wait for the child; returns its wait status, or -1 if fork failed */
+BETATEST_FUNC int betatest_death_wait(pid_t pid) {
+    int status = -1;
+    if (pid < 0) {
+        return -1;
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    betatest_crash.child = 0;
+    return status;
+}
+
+static inline int betatest_died(int status) {
+    return status != -1 && (WIFSIGNALED(status) ||
+                            (WIFEXITED(status) && WEXITSTATUS(status) != 0));
+}
+
+BETATEST_COLD void betatest_fail_death(const char *file, int line,
+                                       const char *stmt, int status) {
+    if (status == -1) {
+        betatest_fail(file, line,
+                      "Assertion failed: cannot fork to run %s: %s", stmt,
+                      strerror(errno));
+        return;
+    }
+    betatest_fail(file, line,
+                  "Assertion failed: expected %s to die, but it finished "
+                  "normally",
+                  stmt);
+}
+
+/* Pass if `stmt` crashes, is killed by a signal or exits non-zero */
+#define ASSERT_DEATH(stmt)                                                     \
     do {                                                                       \
-        memset(&betatest_stats, 0, sizeof(betatest_stats));                    \
+        pid_t _pid = betatest_death_fork();                                    \
+        if (_pid == 0) {                                                       \
+            stmt;                                                              \
+            _exit(0);                                                          \
+        }                                                                      \
+        int _status = betatest_death_wait(_pid);                               \
+        BETATEST_CHECK(betatest_died(_status),                                 \
+                       betatest_fail_death(__FILE__, __LINE__, #stmt,          \
+                                           _status));                          \
     } while (0)
 
+/* Summary and reset */
+BETATEST_FUNC void betatest_summary(void) {
+    betatest_suites_leave_all();
+    betatest_sync_counters();
+    betatest_printf("%s%s", BETATEST_COLOR_BOLD, BETATEST_COLOR_CYAN);
+    betatest_printf("========================================\n");
+    betatest_printf("           TEST SUMMARY\n");
+    betatest_printf("========================================%s\n",
+                    BETATEST_COLOR_RESET);
+    betatest_printf("Tests:      %d run, ", betatest_stats.tests_run);
+    betatest_printf("%s%d passed%s, ", BETATEST_COLOR_GREEN,
+                    betatest_stats.tests_passed, BETATEST_COLOR_RESET);
+    betatest_printf("%s%d failed%s", BETATEST_COLOR_RED,
+                    betatest_stats.tests_failed, BETATEST_COLOR_RESET);
+    if (betatest_stats.tests_timed_out > 0) {
+        betatest_printf(", %s%d timed out%s", BETATEST_COLOR_RED,
+                        betatest_stats.tests_timed_out, BETATEST_COLOR_RESET);
+    }
+    betatest_printf("\n");
+    betatest_printf("Assertions: %d run, ", betatest_stats.assertions_run);
+    betatest_printf("%s%d passed%s, ", BETATEST_COLOR_GREEN,
+                    betatest_stats.assertions_passed, BETATEST_COLOR_RESET);
+    betatest_printf("%s%d failed%s\n", BETATEST_COLOR_RED,
+                    betatest_stats.assertions_failed, BETATEST_COLOR_RESET);
+    if (betatest_regex_cache.hits + betatest_regex_cache.misses > 0) {
+        betatest_printf("Regex cache: %ld hits, %ld misses\n",
+                        betatest_regex_cache.hits, betatest_regex_cache.misses);
+    }
+    if (betatest_slow_threshold_ms() > 0.0) {
+        betatest_printf("Slow:       %s%d over %.3f ms%s\n",
+                        BETATEST_COLOR_YELLOW, betatest_stats.tests_slow,
+                        betatest_slow_threshold_ms(), BETATEST_COLOR_RESET);
+    }
+    int compared = 0;
+    int regressed = 0;
+    for (int i = 0; i < betatest_measurements.count; i++) {
+        compared += betatest_measurements.items[i].compared;
+        regressed += betatest_measurements.items[i].regressed;
+    }
+    if (compared > 0) {
+        betatest_printf("Measures:   %d compared, %s%d regressed%s (threshold "
+                        "%.1f%%)\n",
+                        compared, regressed ? BETATEST_COLOR_RED : "",
+                        regressed, regressed ? BETATEST_COLOR_RESET : "",
+                        betatest_regression_threshold_pct());
+    }
+    betatest_baseline_write();
+    betatest_state_write();
+    if (betatest_options.not_run > 0 && betatest_interrupted) {
+        betatest_printf("%sStopped:    after an interrupted test, %d not "
+                        "run%s\n",
+                        BETATEST_COLOR_YELLOW, betatest_options.not_run,
+                        BETATEST_COLOR_RESET);
+    } else if (betatest_options.not_run > 0) {
+        betatest_printf("%sStopped:    after %d failed test%s (--fail-fast), "
+                        "%d not run%s\n",
+                        BETATEST_COLOR_YELLOW, betatest_options.fail_fast,
+                        betatest_options.fail_fast == 1 ? "" : "s",
+                        betatest_options.not_run, BETATEST_COLOR_RESET);
+    }
+    if (betatest_shard.total > 0) {
+        betatest_printf("Shard:      %d of %d (index %d), by %s\n",
+                        betatest_shard.index + 1, betatest_shard.total,
+                        betatest_shard.index,
+                        betatest_shard.plan ? "duration" : "name hash");
+    }
+    betatest_printf("%s========================================%s\n",
+                    BETATEST_COLOR_CYAN, BETATEST_COLOR_RESET);
+    if (betatest_stats.tests_failed == 0 &&
+        betatest_stats.tests_timed_out == 0) {
+        betatest_printf("%s%sALL TESTS PASSED!%s\n", BETATEST_COLOR_BOLD,
+                        BETATEST_COLOR_GREEN, BETATEST_COLOR_RESET);
+    } else {
+        betatest_printf("%s%sSOME TESTS FAILED%s\n", BETATEST_COLOR_BOLD,
+                        BETATEST_COLOR_RED, BETATEST_COLOR_RESET);
+    }
+    betatest_printf("\n");
+    betatest_print_slowest();
+    betatest_print_benches();
+    betatest_print_stress();
+    betatest_regex_cache_free();
+    betatest_flush_output();
+    betatest_report_end();
+}
+
+BETATEST_FUNC void betatest_reset(void) {
+    betatest_sync_counters();
+    memset(&betatest_stats, 0, sizeof(betatest_stats));
+    free(betatest_timings.entries);
+    memset(&betatest_timings, 0, sizeof(betatest_timings));
+    free(betatest_benches.results);
+    memset(&betatest_benches, 0, sizeof(betatest_benches));
+    free(betatest_stress_results.results);
+    memset(&betatest_stress_results, 0, sizeof(betatest_stress_results));
+    betatest_measurements_free(betatest_measurements.items,
+                               betatest_measurements.count);
+    memset(&betatest_measurements, 0, sizeof(betatest_measurements));
+    betatest_regex_cache_free();
+    betatest_regex_cache.hits = 0;
+    betatest_regex_cache.misses = 0;
+}
+
+#define TEST_SUMMARY() betatest_summary()
+
+#define TEST_RESET() betatest_reset()
+
 /* Return success/failure code */
-#define TEST_RETURN_CODE() (betatest_stats.tests_failed == 0 ? 0 : 1)
+#define TEST_RETURN_CODE()                                                     \
+    (betatest_stats.tests_failed == 0 && betatest_stats.tests_timed_out == 0   \
+         ? 0                                                                   \
+         : 1)
+
+/* Apply --filter/--exclude/--jobs to the RUN_TEST calls of a custom main.
+ * Evaluates to -1 to continue, or to an exit code for --help/bad options. */
+#define TEST_PARSE_ARGS(argc, argv) betatest_parse_args(argc, argv)
+
+/* Registry-driven main: runs every registered test selected on the command
+ * line, in definition order (or last run's failures first) */
+BETATEST_FUNC int betatest_main(int argc, char **argv) {
+    int rc = betatest_parse_args(argc, argv);
+    if (rc >= 0) {
+        return rc;
+    }
+    if (betatest_options.list) {
+        for (int i = 0; i < betatest_registry.count; i++) {
+            const betatest_test *t = &betatest_registry.tests[i];
+            if (t->params != NULL) {
+                betatest_build_cases(t);
+                for (size_t j = 0; j < t->params->ncases; j++) {
+                    printf("%s\n", t->params->cases[j].name);
+                }
+            } else if (betatest_selected(t->name)) {
+                printf("%s\n", t->name);
+            }
+        }
+        for (int i = 0; betatest_options.bench &&
+                        i < betatest_bench_registry.count;
+             i++) {
+            if (betatest_selected(betatest_bench_registry.benches[i].name)) {
+                printf("%s\n", betatest_bench_registry.benches[i].name);
+            }
+        }
+        return 0;
+    }
+    /* Lets each suite be torn down right after its last selected test */
+    for (int i = 0; i < betatest_registry.count; i++) {
+        const betatest_test *t = &betatest_registry.tests[i];
+        if (t->suite != NULL && betatest_selected(t->name)) {
+            t->suite->pending++;
+        }
+    }
+    if (betatest_options.jobs != 1) {
+        RUN_ALL_TESTS_PARALLEL(betatest_options.jobs);
+    } else {
+        int *order = betatest_run_order();
+        for (int i = 0; i < betatest_registry.count; i++) {
+            betatest_run_test(&betatest_registry.tests[order ? order[i] : i]);
+        }
+        free(order);
+    }
+    for (int i = 0; betatest_options.bench && !betatest_stop_running() &&
+                    i < betatest_bench_registry.count;
+         i++) {
+        betatest_run_bench(betatest_bench_registry.benches[i].name,
+                           betatest_bench_registry.benches[i].fn);
+    }
+    TEST_SUMMARY();
+    return TEST_RETURN_CODE();
+}
+
+#define BETATEST_MAIN()                                                        \
+    int main(int argc, char **argv) { return betatest_main(argc, argv); }
 
 #endif /* BETATEST_H */
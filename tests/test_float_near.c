@@ -0,0 +1,23 @@
+/* The vectorised float comparison must agree with betatest_float_near. A
+ * relative tolerance just below the real difference used to pass once it
+ * was rounded to float. */
+#include "betatest.h"
+
+TEST(float_block_rel_eps) {
+    float a[64];
+    float b[64];
+    for (int i = 0; i < 64; i++) {
+        a[i] = 1.0f;
+        b[i] = 1.0f;
+    }
+    b[5] = 1.0f + 0x1p-21f;
+    double rel_eps = ((double)b[5] - 1.0) / (double)b[5] * (1 - 1e-9);
+    betatest_diff diff;
+    ASSERT_FALSE(betatest_float_near(a[5], b[5], 0, 0, rel_eps, -1));
+    ASSERT_INT_EQ((long)betatest_floats_diff(a, b, 64, sizeof(float), 0,
+                                             rel_eps, -1, &diff),
+                  1);
+    ASSERT_INT_EQ((long)diff.first, 5);
+}
+
+BETATEST_MAIN()
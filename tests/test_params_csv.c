@@ -0,0 +1,23 @@
+/* TEST_P_CSV must copy case lines of any length, not only ones that fit in
+ * the line buffer after a single doubling. Each line is "length,payload". */
+#include "betatest.h"
+
+typedef struct {
+    long want;
+    size_t got;
+} csv_case;
+
+static int parse_case(const char *line, csv_case *out) {
+    char *end;
+    out->want = strtol(line, &end, 10);
+    if (*end != ',') {
+        return -1;
+    }
+    out->got = strlen(end + 1);
+    return 0;
+}
+
+TEST_P(long_lines, csv_case) { ASSERT_INT_EQ((long)param->got, param->want); }
+TEST_P_CSV(long_lines, BETATEST_TEST_DATA "/long_lines.csv", parse_case);
+
+BETATEST_MAIN()
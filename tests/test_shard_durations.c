@@ -0,0 +1,34 @@
+/* --shard-durations must read test names back the way the json reporter
+ * escaped them, whatever characters they contain. */
+#include "betatest.h"
+
+static const char report[] =
+    "{\"type\":\"start\"}\n"
+    "{\"type\":\"test\",\"name\":\"quote\\\"d, \\\"wall_ms\\\":1\","
+    "\"status\":\"passed\",\"wall_ms\":12.5,\"cpu_ms\":1.0}\n"
+    "{\"type\":\"test\",\"name\":\"tab\\there\\u00e9\",\"status\":\"failed\","
+    "\"wall_ms\":3.25,\"cpu_ms\":1.0,\"failures\":[{\"message\":"
+    "\"{\\\"type\\\":\\\"test\\\",\\\"wall_ms\\\":99\"}]}\n"
+    "{\"type\":\"test\",\"name\":\"cut short\\\n";
+
+TEST(escaped_names) {
+    char path[] = "/tmp/betatest-durations-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_TRUE(fd >= 0);
+    ASSERT_INT_EQ(betatest_write_full(fd, report, sizeof(report) - 1), 0);
+    close(fd);
+    betatest_shard_entry *items = NULL;
+    int count = betatest_read_durations(path, &items);
+    unlink(path);
+    ASSERT_INT_EQ(count, 2);
+    ASSERT_STR_EQ(items[0].name, "quote\"d, \"wall_ms\":1");
+    ASSERT_FLOAT_EQ(items[0].ms, 12.5, 1e-9);
+    ASSERT_STR_EQ(items[1].name, "tab\there\xc3\xa9");
+    ASSERT_FLOAT_EQ(items[1].ms, 3.25, 1e-9);
+    for (int i = 0; i < count; i++) {
+        free((char *)items[i].name);
+    }
+    free(items);
+}
+
+BETATEST_MAIN()
@@ -0,0 +1,51 @@
+/* A worker killed half way through sending a record must not make the
+ * parent report whatever was left in its receive buffers. Each test forks
+ * a stand-in worker that writes the start of a record and is killed. */
+#include "betatest.h"
+
+/* Fork a child that writes `len` bytes of `buf` and then kills itself.
+ * Returns the read end of its pipe. */
+static int killed_worker(const void *buf, size_t len) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        betatest_write_full(fds[1], buf, len);
+        kill(getpid(), SIGKILL);
+    }
+    close(fds[1]);
+    waitpid(pid, NULL, 0);
+    return fds[0];
+}
+
+TEST(failure_record_cut_short) {
+    /* The header and the file name, but none of the 64 message bytes */
+    struct {
+        betatest_wire_failure wire;
+        char file[8];
+    } record = {{12, 8, 64}, "file.c"};
+    int fd = killed_worker(&record, sizeof(record));
+    ASSERT_TRUE(fd >= 0);
+    ASSERT_INT_EQ(betatest_recv_failures(fd, 1), -1);
+    ASSERT_INT_EQ(betatest_failures.count, 0);
+    close(fd);
+}
+
+TEST(measurement_record_cut_short) {
+    /* The header and the key, but none of the 4 samples */
+    struct {
+        betatest_wire_measurement wire;
+        char key[8];
+    } record = {{8, 4, 0, 0}, "bench/x"};
+    int count = betatest_measurements.count;
+    int fd = killed_worker(&record, sizeof(record));
+    ASSERT_TRUE(fd >= 0);
+    ASSERT_INT_EQ(betatest_recv_measurements(fd, 1), -1);
+    ASSERT_INT_EQ(betatest_measurements.count, count);
+    close(fd);
+}
+
+BETATEST_MAIN()